@@ -0,0 +1,76 @@
+#include <linux/types.h>
+#include <arm_neon.h>
+
+#include "cdata-fb-neon.h"
+
+/*
+ * NEON loops for cdata-fb.  This is the only object built with
+ * -mfpu=neon, so the compiler cannot vectorize anything else in the
+ * driver behind kernel_neon_begin()'s back.  The callers own the
+ * begin/end bracket; every function here runs entirely inside it,
+ * handles whole groups of 8 pixels and returns how many it did.
+ */
+
+unsigned int cdata_neon_rgb565(u32 *dst, const u8 *src, unsigned int n)
+{
+	const u16 *s = (const u16 *)src;
+	unsigned int i;
+	uint8x8x4_t out;
+
+	out.val[3] = vdup_n_u8(0);
+
+	for (i = 0; i + 8 <= n; i += 8) {
+	    uint16x8_t p = vld1q_u16(s+i);
+	    uint8x8_t r = vshrn_n_u16(p, 8);		/* RRRRRGGG */
+	    uint8x8_t g = vshrn_n_u16(p, 3);		/* GGGGGGBB */
+	    uint8x8_t b = vmovn_u16(vshlq_n_u16(p, 3));	/* BBBBB000 */
+
+	    /* replicate the top bits into the low ones */
+	    out.val[0] = vsri_n_u8(b, b, 5);
+	    out.val[1] = vsri_n_u8(g, g, 6);
+	    out.val[2] = vsri_n_u8(r, r, 5);
+	    vst4_u8((u8 *)(dst+i), out);
+	}
+
+	return i;
+}
+
+unsigned int cdata_neon_rgb888(u32 *dst, const u8 *src, unsigned int n)
+{
+	unsigned int i;
+	uint8x8x3_t in;
+	uint8x8x4_t out;
+
+	out.val[3] = vdup_n_u8(0);
+
+	for (i = 0; i + 8 <= n; i += 8) {
+	    in = vld3_u8(src+i*3);
+	    out.val[0] = in.val[0];
+	    out.val[1] = in.val[1];
+	    out.val[2] = in.val[2];
+	    vst4_u8((u8 *)(dst+i), out);
+	}
+
+	return i;
+}
+
+/* dither only: the same threshold for all three channels of a pixel */
+unsigned int cdata_neon_dither(u32 *p, unsigned int n, const u8 *th,
+		u8 mask)
+{
+	uint8x8_t t, m;
+	uint8x8x4_t px;
+	unsigned int i;
+
+	t = vld1_u8(th);
+	m = vdup_n_u8(mask);
+	for (i = 0; i + 8 <= n; i += 8) {
+	    px = vld4_u8((u8 *)(p+i));
+	    px.val[0] = vand_u8(vqadd_u8(px.val[0], t), m);
+	    px.val[1] = vand_u8(vqadd_u8(px.val[1], t), m);
+	    px.val[2] = vand_u8(vqadd_u8(px.val[2], t), m);
+	    vst4_u8((u8 *)(p+i), px);
+	}
+
+	return i;
+}
@@ -0,0 +1,14 @@
+#ifndef _CDATA_FB_NEON_H_
+#define	_CDATA_FB_NEON_H_
+
+/*
+ * cdata-fb-neon.o, linked in with CONFIG_KERNEL_MODE_NEON.  Call only
+ * between kernel_neon_begin() and kernel_neon_end(), and only when
+ * cpu_has_neon().
+ */
+unsigned int cdata_neon_rgb565(u32 *dst, const u8 *src, unsigned int n);
+unsigned int cdata_neon_rgb888(u32 *dst, const u8 *src, unsigned int n);
+unsigned int cdata_neon_dither(u32 *p, unsigned int n, const u8 *th,
+		u8 mask);
+
+#endif
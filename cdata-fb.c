@@ -12,106 +12,1883 @@
 #include <linux/irq.h>
 #include <linux/miscdevice.h>
 #include <linux/input.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include <linux/rwsem.h>
+#include <linux/kthread.h>
+#include <linux/list.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/kref.h>
+#include <linux/mutex.h>
+#include <linux/platform_device.h>
 //#include <linux/config.h>
-#include <linux/tqueue.h>
 #include <asm/io.h>
 #include <asm/uaccess.h>
-#include <asm/hardware.h>
+#ifdef CONFIG_KERNEL_MODE_NEON
+#include <asm/neon.h>
+#include "cdata-fb-neon.h"
+#define	CDATA_FB_NEON
+#endif
+
+#include "cdata_ioctl.h"
+
+#define	LCD_WIDTH	(240)
+#define	LCD_HEIGHT	(320)
+#define	LCD_BPP		(4)
+#define	LCD_LENGTH	(LCD_WIDTH*LCD_HEIGHT*LCD_BPP)
+#define	LCD_SIZE	(LCD_WIDTH*LCD_HEIGHT)
+
+#define	LCD_LINE	(LCD_WIDTH*LCD_BPP)
+
+#define	CDATA_FB_MINOR	(40)
+
+/* panel memory reserved at the top of SDRAM */
+#define	LCD_PHYS	(0x33f00000)
+#define	LCD_VMEM	(0x00100000)
+
+/* S3C2410 LCD controller frame buffer start address registers */
+#define	S3C2410_LCD_BASE	(0x4d000000)
+#define	S3C2410_LCDSADDR1	(0x14)
+#define	S3C2410_LCDSADDR2	(0x18)
+
+/* CDATA_SET_ATLAS limits */
+#define	FONT_MAX_HEIGHT	(64)
+#define	FONT_MAX_GLYPHS	(4096)
+
+/* rotated flushes go out ROT_BAND frame rows at a time */
+#define	ROT_BAND	(16)
+#define	ROT_BLOCK	(8)
+
+typedef void (*cdata_cvt_t)(u32 *dst, const u8 *src, unsigned int n,
+				const u32 *pal);
+
+/* client pixel format, converted to the panel format at flush time */
+struct cdata_fmt {
+	unsigned int	bpp;		/* bytes per source pixel */
+	cdata_cvt_t	cvt;
+	u32		(*pack)(u32 xrgb, const u32 *pal);
+};
+
+/* [x0, x1) x [y0, y1) in shadow pixels and rows, empty if x0 >= x1 */
+struct cdata_box {
+	unsigned int	x0, y0;
+	unsigned int	x1, y1;
+};
+
+/*
+ * Flush counters, updated under fb->lock once per flush and read back
+ * through debugfs.  There is no frame interrupt hooked up, so vblanks
+ * are taken on a grid of the nominal refresh rate: every grid line a
+ * flush straddles is a frame scanned out half updated.
+ */
+struct cdata_fb_stats {
+	u64		frames;		/* flushes that reached the panel */
+	u64		bytes;		/* written to panel memory */
+	u64		pixels;		/* of the visible window, flushed */
+	u64		flush_ns;
+	u64		flush_max_ns;
+	u64		missed;		/* vblanks during a flush */
+	u64		written;	/* bytes write() was given */
+	u64		changed;	/* of those, in changed cache lines */
+	ktime_t		since;		/* last reset */
+};
+
+/*
+ * A client's own drawing surface, one per open.  Layers live in the
+ * frame's pixel format and are stacked by z; alpha applies to the
+ * whole layer.
+ */
+struct cdata_layer {
+	struct list_head	list;	/* on fb->layers, bottom to top */
+	unsigned char	*buf;		/* w*h pixels */
+	int		x, y;		/* position in the frame */
+	unsigned int	w, h;
+	int		z;
+	unsigned int	alpha;		/* 255 is opaque */
+	int		shown;		/* drawn into at least once */
+	atomic_t	mapped;		/* vmas on buf */
+	struct cdata_box	dirty;	/* in layer pixels and rows */
+};
+
+/*
+ * A published copy of the shadow, one page per shadow page.  Pages
+ * the compositor has not drawn to since the previous snapshot are
+ * shared with it rather than copied.  Readers and mappings hold a
+ * reference, so a snapshot never changes once it is published.
+ */
+struct cdata_snap {
+	struct kref	ref;
+	struct cdata_snapshot	info;
+	unsigned int	npages;
+	struct page	*pages[0];
+};
+
+/*
+ * One panel shared by every open.  The shadow is the composed virtual
+ * frame, xres wide and yres_virtual rows tall, kept in the client
+ * format.  The compositor thread blends the damaged parts of the
+ * layers into it, then converts the damaged rows that are on screen,
+ * rotates them and copies them to the panel.
+ */
+struct cdata_fb {
+	unsigned char	*fb;		/* panel memory */
+	unsigned char	*regs;		/* LCD controller, hwpan only */
+	unsigned char	*shadow;	/* rows panel rows of 32bpp */
+	unsigned int	rows;
+	unsigned int	pitch;		/* bytes per shadow row */
+	unsigned int	xres, yres;	/* the frame as clients see it */
+	unsigned int	yres_virtual;
+	unsigned int	yoffset;	/* shadow row at the top of the panel */
+	unsigned int	rotate;		/* clockwise, in degrees */
+
+	struct cdata_fmt	*fmt;
+	u32		pal[256];	/* CDATA_FMT_C8 palette */
+	u32		*line;		/* one row in panel pixels */
+	u32		*tile;		/* ROT_BAND frame rows, converted */
+	u32		*rot;		/* the same, transposed */
+
+	/* CDATA_SET_CORRECTION, NULL when off */
+	u8		(*ctab)[3][256];	/* per dither cell */
+	unsigned int	corr;
+	unsigned int	dither_step;
+
+	/* set when the controller can move its scanout base itself */
+	int		(*pan)(struct cdata_fb *, unsigned int yoffset);
+
+	/* fmt, pitch, the layer list and layer buffers */
+	struct rw_semaphore	mode_sem;
+
+	spinlock_t	lock;		/* damage, pending, yoffset */
+	struct cdata_box	comp;	/* frame area to recompose */
+	struct cdata_box	dirty;	/* shadow area to flush */
+	int		repaint;	/* whole visible window */
+	int		pending;
+	struct cdata_fb_stats	stats;
+
+	/* snapshots, published by the compositor */
+	struct cdata_snap	*snap;
+	struct cdata_box	snap_dirty;	/* shadow drawn since */
+	unsigned int	snap_seq;
+	int		snap_req;
+	int		snap_ret;
+	wait_queue_head_t	snap_wq;
+
+	struct list_head	layers;
+	wait_queue_head_t	wq;
+	struct task_struct	*compositor;
+	struct dentry	*debugfs;
+};
+
+/* a glyph atlas, every row left-aligned in a word */
+struct cdata_font {
+	unsigned int	width, height;
+	unsigned int	count;
+	u32		*bits;		/* count*height rows */
+};
+
+struct cdata_t {
+	struct cdata_fb	*dev;
+	struct cdata_layer	layer;
+	struct cdata_snap	*snap;	/* last CDATA_SNAPSHOT, fb->lock */
+
+	/* command ring, allocated on the first mmap() of it */
+	struct mutex	ring_lock;
+	struct cdata_ring	*ring;
+	unsigned int	ring_head;	/* run so far; ring->head is a copy */
+	unsigned int	ring_tail;	/* last doorbell */
+	struct work_struct	ring_work;
+
+	struct cdata_font	*font;	/* mode_sem */
+};
+
+static struct cdata_fb *cdata_fb;
+
+static unsigned int yres_virtual = LCD_HEIGHT*2;
+module_param(yres_virtual, uint, 0444);
+MODULE_PARM_DESC(yres_virtual, "rows in the virtual frame (>= 320)");
+
+static bool hwpan;
+module_param(hwpan, bool, 0444);
+MODULE_PARM_DESC(hwpan, "pan by moving the LCDSADDR scanout base");
+
+static unsigned int refresh = 60;
+module_param(refresh, uint, 0644);
+MODULE_PARM_DESC(refresh, "panel refresh rate in Hz, for the vblank statistics");
+
+static unsigned int rotate;
+module_param(rotate, uint, 0444);
+MODULE_PARM_DESC(rotate, "initial clockwise rotation: 0, 90, 180 or 270");
+
+static int 	delay;
+
+#ifndef	MODULE
+/**
+ * cdata=x,y
+ */
+int __init cdata_setup(char *str)
+{
+	int ints[2];
+
+	str = get_options(str, ARRAY_SIZE(ints), ints);
+
+	if (ints[0] == 1)
+	    delay = 1;
+	return 0;
+}
+
+__setup("cdata=", cdata_setup);
+#endif
+
+/*** pixel format conversion *****/
+
+/*
+ * Every converter turns n source pixels into n XRGB8888 panel pixels.
+ * The scalar versions are always there; on kernels with
+ * CONFIG_KERNEL_MODE_NEON, and when the CPU has it, cdata_fmt_init()
+ * swaps in ones that run the loops of cdata-fb-neon.c.
+ */
+static void cvt_xrgb8888(u32 *dst, const u8 *src, unsigned int n,
+				const u32 *pal)
+{
+	memcpy(dst, src, n*4);
+}
+
+static inline u32 rgb565_to_xrgb(u16 p)
+{
+	u32 r = (p >> 11) & 0x1f;
+	u32 g = (p >> 5) & 0x3f;
+	u32 b = p & 0x1f;
+
+	r = (r << 3) | (r >> 2);
+	g = (g << 2) | (g >> 4);
+	b = (b << 3) | (b >> 2);
+
+	return (r << 16) | (g << 8) | b;
+}
+
+static void cvt_rgb565(u32 *dst, const u8 *src, unsigned int n,
+				const u32 *pal)
+{
+	const u16 *s = (const u16 *)src;
+	unsigned int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+	    dst[i] = rgb565_to_xrgb(s[i]);
+	    dst[i+1] = rgb565_to_xrgb(s[i+1]);
+	    dst[i+2] = rgb565_to_xrgb(s[i+2]);
+	    dst[i+3] = rgb565_to_xrgb(s[i+3]);
+	}
+	for (; i < n; i++)
+	    dst[i] = rgb565_to_xrgb(s[i]);
+}
+
+static void cvt_rgb888(u32 *dst, const u8 *src, unsigned int n,
+				const u32 *pal)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++, src += 3)
+	    dst[i] = src[0] | (src[1] << 8) | (src[2] << 16);
+}
+
+static void cvt_c8(u32 *dst, const u8 *src, unsigned int n,
+				const u32 *pal)
+{
+	unsigned int i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+	    dst[i] = pal[src[i]];
+	    dst[i+1] = pal[src[i+1]];
+	    dst[i+2] = pal[src[i+2]];
+	    dst[i+3] = pal[src[i+3]];
+	}
+	for (; i < n; i++)
+	    dst[i] = pal[src[i]];
+}
+
+#ifdef CDATA_FB_NEON
+/*
+ * Only cdata-fb-neon.o is built for NEON; the register save and
+ * restore stays on this side, around the whole call.
+ */
+static void cvt_rgb565_neon(u32 *dst, const u8 *src, unsigned int n,
+				const u32 *pal)
+{
+	unsigned int i;
+
+	kernel_neon_begin();
+	i = cdata_neon_rgb565(dst, src, n);
+	kernel_neon_end();
+
+	cvt_rgb565(dst+i, src+i*2, n-i, pal);
+}
+
+static void cvt_rgb888_neon(u32 *dst, const u8 *src, unsigned int n,
+				const u32 *pal)
+{
+	unsigned int i;
+
+	kernel_neon_begin();
+	i = cdata_neon_rgb888(dst, src, n);
+	kernel_neon_end();
+
+	cvt_rgb888(dst+i, src+i*3, n-i, pal);
+}
+#endif
+
+/* the other way round, for the solid fills */
+static u32 pack_xrgb8888(u32 c, const u32 *pal)
+{
+	return c & 0xffffff;
+}
+
+static u32 pack_rgb565(u32 c, const u32 *pal)
+{
+	return ((c >> 8) & 0xf800) | ((c >> 5) & 0x07e0) | ((c >> 3) & 0x001f);
+}
+
+static u32 pack_c8(u32 c, const u32 *pal)
+{
+	unsigned int i, best, d, dmin;
+	int dr, dg, db;
+
+	best = 0;
+	dmin = ~0U;
+	for (i = 0; i < 256; i++) {
+	    dr = ((pal[i] >> 16) & 0xff) - ((c >> 16) & 0xff);
+	    dg = ((pal[i] >> 8) & 0xff) - ((c >> 8) & 0xff);
+	    db = (pal[i] & 0xff) - (c & 0xff);
+	    d = dr*dr + dg*dg + db*db;
+	    if (d < dmin) {
+		dmin = d;
+		best = i;
+	    }
+	}
+
+	return best;
+}
+
+static struct cdata_fmt cdata_fmts[] = {
+	[CDATA_FMT_XRGB8888]	= { 4, cvt_xrgb8888, pack_xrgb8888 },
+	[CDATA_FMT_RGB565]	= { 2, cvt_rgb565, pack_rgb565 },
+	[CDATA_FMT_RGB888]	= { 3, cvt_rgb888, pack_xrgb8888 },
+	[CDATA_FMT_C8]		= { 1, cvt_c8, pack_c8 },
+};
+
+static void cdata_fmt_init(void)
+{
+#ifdef CDATA_FB_NEON
+	if (cpu_has_neon()) {
+	    cdata_fmts[CDATA_FMT_RGB565].cvt = cvt_rgb565_neon;
+	    cdata_fmts[CDATA_FMT_RGB888].cvt = cvt_rgb888_neon;
+	}
+#endif
+}
+
+/* RGB 3:3:2 until a client loads its own palette */
+static void cdata_default_palette(u32 *pal)
+{
+	unsigned int i, r, g, b;
+
+	for (i = 0; i < 256; i++) {
+	    r = (i >> 5) & 0x7;
+	    g = (i >> 2) & 0x7;
+	    b = i & 0x3;
+	    pal[i] = ((r * 255 / 7) << 16) | ((g * 255 / 7) << 8) |
+	    		(b * 255 / 3);
+	}
+}
+
+/*** colour correction *****/
+
+static const u8 bayer4[4][4] = {
+	{  0,  8,  2, 10 },
+	{ 12,  4, 14,  6 },
+	{  3, 11,  1,  9 },
+	{ 15,  7, 13,  5 },
+};
+
+/*
+ * One table per dither cell, with the LUT and the dither folded in:
+ * ctab[cell][ch][v] is channel ch of value v, mapped, biased by the
+ * cell's threshold and cut to the panel depth.  A corrected pixel is
+ * then three lookups whatever is switched on.
+ */
+static u8 (*cdata_ctab_build(const struct cdata_correction *c))[3][256]
+{
+	u8 (*ctab)[3][256];
+	unsigned int cell, ch, v, t, q, step;
+
+	ctab = kmalloc(16*sizeof(*ctab), GFP_KERNEL);
+	if (!ctab)
+	    return NULL;
+
+	step = (c->flags & CDATA_CORR_DITHER) ? 1 << (8 - c->dither_bits) : 1;
+
+	for (cell = 0; cell < 16; cell++) {
+	    t = bayer4[cell / 4][cell % 4] * step / 16;
+	    for (ch = 0; ch < 3; ch++) {
+		for (v = 0; v < 256; v++) {
+		    q = (c->flags & CDATA_CORR_LUT) ? c->lut[ch][v] : v;
+		    q = min(q + t, 255U);
+		    ctab[cell][ch][v] = q & ~(step - 1);
+		}
+	    }
+	}
+
+	return ctab;
+}
+
+#ifdef CDATA_FB_NEON
+/* dither only: the same threshold for all three channels of a pixel */
+static unsigned int lcd_dither_neon(struct cdata_fb *fb, u32 *p,
+		unsigned int n, unsigned int x, unsigned int y)
+{
+	unsigned int step = fb->dither_step;
+	u8 th[8];
+	unsigned int i;
+
+	for (i = 0; i < 8; i++)
+	    th[i] = bayer4[y & 3][(x + i) & 3] * step / 16;
+
+	kernel_neon_begin();
+	i = cdata_neon_dither(p, n, th, ~(step - 1));
+	kernel_neon_end();
+
+	return i;
+}
+#endif
+
+/* n panel pixels bound for (x, y) of the panel, mode_sem held */
+static void lcd_correct(struct cdata_fb *fb, u32 *p, unsigned int n,
+		unsigned int x, unsigned int y)
+{
+	u8 (*row)[3][256] = fb->ctab + (y & 3)*4;
+	u8 (*c)[256];
+	unsigned int i = 0;
+	u32 v;
+
+	if (!fb->ctab)
+	    return;
+
+#ifdef CDATA_FB_NEON
+	if (fb->corr == CDATA_CORR_DITHER && cpu_has_neon())
+	    i = lcd_dither_neon(fb, p, n, x, y);
+#endif
+
+	for (; i < n; i++) {
+	    c = row[(x + i) & 3];
+	    v = p[i];
+	    p[i] = (c[0][(v >> 16) & 0xff] << 16) |
+	    	   (c[1][(v >> 8) & 0xff] << 8) | c[2][v & 0xff];
+	}
+}
+
+/*** damage tracking *****/
+
+static inline void box_clear(struct cdata_box *b)
+{
+	b->x0 = b->y0 = ~0U;
+	b->x1 = b->y1 = 0;
+}
+
+static inline int box_empty(const struct cdata_box *b)
+{
+	return b->x0 >= b->x1 || b->y0 >= b->y1;
+}
+
+static inline void box_union(struct cdata_box *b, unsigned int x0,
+		unsigned int y0, unsigned int x1, unsigned int y1)
+{
+	if (x0 < b->x0) b->x0 = x0;
+	if (y0 < b->y0) b->y0 = y0;
+	if (x1 > b->x1) b->x1 = x1;
+	if (y1 > b->y1) b->y1 = y1;
+}
+
+/* clip a rectangle in frame coordinates to the frame, 0 if nothing is left */
+static int frame_clip(struct cdata_fb *fb, int x0, int y0, int x1, int y1,
+		struct cdata_box *b)
+{
+	if (x0 < 0) x0 = 0;
+	if (y0 < 0) y0 = 0;
+	if (x1 > (int)fb->xres) x1 = fb->xres;
+	if (y1 > (int)fb->yres_virtual) y1 = fb->yres_virtual;
+
+	if (x0 >= x1 || y0 >= y1)
+	    return 0;
+
+	b->x0 = x0;
+	b->y0 = y0;
+	b->x1 = x1;
+	b->y1 = y1;
+	return 1;
+}
+
+/* called with fb->lock held */
+static inline void cdata_fb_kick(struct cdata_fb *fb)
+{
+	fb->pending = 1;
+	wake_up(&fb->wq);
+}
+
+/* frame area to recompose, e.g. where a layer used to be */
+static void cdata_fb_damage(struct cdata_fb *fb, int x0, int y0,
+		int x1, int y1)
+{
+	struct cdata_box b;
+	unsigned long flags;
+
+	if (!frame_clip(fb, x0, y0, x1, y1, &b))
+	    return;
+
+	spin_lock_irqsave(&fb->lock, flags);
+	box_union(&fb->comp, b.x0, b.y0, b.x1, b.y1);
+	cdata_fb_kick(fb);
+	spin_unlock_irqrestore(&fb->lock, flags);
+}
+
+static void cdata_layer_damage(struct cdata_fb *fb, struct cdata_layer *l,
+		unsigned int x0, unsigned int y0, unsigned int x1, unsigned int y1)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&fb->lock, flags);
+	box_union(&l->dirty, x0, y0, x1, y1);
+	l->shown = 1;
+	cdata_fb_kick(fb);
+	spin_unlock_irqrestore(&fb->lock, flags);
+}
+
+/* add len bytes of the layer starting at pos, no wrap, to d */
+static void span_box(struct cdata_layer *l, unsigned int bpp,
+		unsigned int pos, unsigned int len, struct cdata_box *d)
+{
+	unsigned int pitch = l->w * bpp;
+	unsigned int y0, y1;
+
+	if (!len)
+	    return;
+
+	y0 = pos / pitch;
+	y1 = (pos+len-1) / pitch;
+
+	if (y0 == y1)
+	    box_union(d, (pos % pitch) / bpp, y0,
+	    		((pos+len-1) % pitch) / bpp + 1, y1 + 1);
+	else
+	    box_union(d, 0, y0, l->w, y1 + 1);
+}
+
+static void cdata_layer_damage_span(struct cdata_fb *fb,
+		struct cdata_layer *l, unsigned int pos, unsigned int len)
+{
+	struct cdata_box d;
+
+	box_clear(&d);
+	span_box(l, fb->fmt->bpp, pos, len, &d);
+	if (!box_empty(&d))
+	    cdata_layer_damage(fb, l, d.x0, d.y0, d.x1, d.y1);
+}
+
+/* n pixels of packed colour c from p on */
+static void fill_span(u8 *p, unsigned int bpp, u32 c, unsigned int n)
+{
+	unsigned int i;
+
+	switch (bpp) {
+	case 1:
+	    memset(p, c, n);
+	    break;
+	case 2:
+	    for (i = 0; i < n; i++)
+		((u16 *)p)[i] = c;
+	    break;
+	case 3:
+	    for (i = 0; i < n; i++, p += 3) {
+		p[0] = c;
+		p[1] = c >> 8;
+		p[2] = c >> 16;
+	    }
+	    break;
+	default:
+	    for (i = 0; i < n; i++)
+		((u32 *)p)[i] = c;
+	}
+}
+
+/* fill a whole layer with a solid colour */
+static void cdata_layer_fill(struct cdata_fb *fb, struct cdata_layer *l,
+		u32 xrgb)
+{
+	fill_span(l->buf, fb->fmt->bpp, fb->fmt->pack(xrgb, fb->pal),
+			l->w*l->h);
+
+	cdata_layer_damage(fb, l, 0, 0, l->w, l->h);
+}
+
+/*** compositor *****/
+
+/* dst = src*a + dst*(1-a), red and blue in one multiply */
+static void blend_row(u32 *dst, const u32 *src, unsigned int n,
+		unsigned int alpha)
+{
+	unsigned int a = alpha + (alpha >> 7);	/* 0..256 */
+	u32 s, d, rb, g;
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+	    s = src[i];
+	    d = dst[i];
+	    rb = ((s & 0x00ff00ff) * a + (d & 0x00ff00ff) * (256 - a)) >> 8;
+	    g = ((s & 0x0000ff00) * a + (d & 0x0000ff00) * (256 - a)) >> 8;
+	    dst[i] = (rb & 0x00ff00ff) | (g & 0x0000ff00);
+	}
+}
+
+/*
+ * Rebuild the part of the shadow covered by the layers' damage: clear
+ * it, then copy or blend every layer that overlaps it, bottom to top.
+ * Only XRGB8888 frames are blended; in the other formats the alpha is
+ * ignored and layers are opaque.
+ */
+static void cdata_fb_compose(struct cdata_fb *fb)
+{
+	struct cdata_layer *l;
+	struct cdata_box d, b;
+	unsigned int bpp, y, n;
+	unsigned char *src, *dst;
+
+	down_read(&fb->mode_sem);
+
+	spin_lock_irq(&fb->lock);
+	d = fb->comp;
+	box_clear(&fb->comp);
+	list_for_each_entry(l, &fb->layers, list) {
+	    if (box_empty(&l->dirty))
+		continue;
+	    if (frame_clip(fb, l->x + l->dirty.x0, l->y + l->dirty.y0,
+	    		l->x + l->dirty.x1, l->y + l->dirty.y1, &b))
+		box_union(&d, b.x0, b.y0, b.x1, b.y1);
+	    box_clear(&l->dirty);
+	}
+	spin_unlock_irq(&fb->lock);
+
+	if (box_empty(&d))
+	    goto out;
+
+	bpp = fb->fmt->bpp;
+
+	for (y = d.y0; y < d.y1; y++)
+	    memset(fb->shadow + y*fb->pitch + d.x0*bpp, 0, (d.x1-d.x0)*bpp);
+
+	list_for_each_entry(l, &fb->layers, list) {
+	    if (!l->shown || !frame_clip(fb,
+	    		max(l->x, (int)d.x0), max(l->y, (int)d.y0),
+	    		min(l->x + (int)l->w, (int)d.x1),
+			min(l->y + (int)l->h, (int)d.y1), &b))
+		continue;
+
+	    n = b.x1 - b.x0;
+	    for (y = b.y0; y < b.y1; y++) {
+		src = l->buf + ((y - l->y)*l->w + b.x0 - l->x)*bpp;
+		dst = fb->shadow + y*fb->pitch + b.x0*bpp;
+
+		if (l->alpha >= 255 || bpp != 4)
+		    memcpy(dst, src, n*bpp);
+		else
+		    blend_row((u32 *)dst, (const u32 *)src, n, l->alpha);
+	    }
+	}
+
+	spin_lock_irq(&fb->lock);
+	box_union(&fb->dirty, d.x0, d.y0, d.x1, d.y1);
+	box_union(&fb->snap_dirty, d.x0, d.y0, d.x1, d.y1);
+	spin_unlock_irq(&fb->lock);
+
+out:
+	up_read(&fb->mode_sem);
+}
+
+/*** snapshots *****/
+
+static void cdata_snap_release(struct kref *ref)
+{
+	struct cdata_snap *snap = container_of(ref, struct cdata_snap, ref);
+	unsigned int i;
+
+	for (i = 0; i < snap->npages; i++)
+	    put_page(snap->pages[i]);
+	kfree(snap);
+}
+
+static inline void cdata_snap_put(struct cdata_snap *snap)
+{
+	if (snap)
+	    kref_put(&snap->ref, cdata_snap_release);
+}
+
+/*
+ * Copy the shadow, mode_sem held.  Only the pages under the shadow
+ * rows in d are copied if the frame still has old's layout; the rest
+ * are taken from old.
+ */
+static struct cdata_snap *cdata_snap_build(struct cdata_fb *fb,
+		struct cdata_snap *old, const struct cdata_box *d,
+		unsigned int yoffset)
+{
+	struct cdata_snap *snap;
+	struct page *page;
+	unsigned int size, npages, first, last, i, off, len;
+	int share;
+
+	size = fb->pitch * fb->yres_virtual;
+	npages = PAGE_ALIGN(size) >> PAGE_SHIFT;
+
+	snap = kzalloc(sizeof(struct cdata_snap)
+			+ npages*sizeof(struct page *), GFP_KERNEL);
+	if (!snap)
+	    return NULL;
+
+	kref_init(&snap->ref);
+	snap->info.format = fb->fmt - cdata_fmts;
+	snap->info.width = fb->xres;
+	snap->info.height = fb->yres_virtual;
+	snap->info.pitch = fb->pitch;
+	snap->info.yoffset = yoffset;
+	snap->info.rotate = fb->rotate;
+	snap->info.size = size;
+
+	share = old && old->info.format == snap->info.format &&
+		old->info.pitch == fb->pitch &&
+		old->info.height == fb->yres_virtual;
+
+	first = last = 0;
+	if (!box_empty(d)) {
+	    first = (d->y0*fb->pitch) >> PAGE_SHIFT;
+	    last = PAGE_ALIGN(d->y1*fb->pitch) >> PAGE_SHIFT;
+	}
+
+	for (i = 0; i < npages; i++, snap->npages++) {
+	    if (share && (i < first || i >= last)) {
+		get_page(old->pages[i]);
+		snap->pages[i] = old->pages[i];
+		continue;
+	    }
+
+	    page = alloc_page(GFP_KERNEL);
+	    if (!page) {
+		cdata_snap_put(snap);
+		return NULL;
+	    }
+
+	    off = i << PAGE_SHIFT;
+	    len = min_t(unsigned int, PAGE_SIZE, size - off);
+	    memcpy(page_address(page), fb->shadow + off, len);
+	    if (len < PAGE_SIZE)
+		memset(page_address(page) + len, 0, PAGE_SIZE - len);
+	    snap->pages[i] = page;
+	}
+
+	return snap;
+}
+
+/*
+ * Run by the compositor between composing and flushing, the only
+ * time the shadow is known to hold whole frames.  Writers keep
+ * drawing into their layers meanwhile.
+ */
+static void cdata_fb_snapshot(struct cdata_fb *fb)
+{
+	struct cdata_snap *old, *snap;
+	struct cdata_box d;
+	unsigned int yoffset;
+
+	down_read(&fb->mode_sem);
+
+	spin_lock_irq(&fb->lock);
+	fb->snap_req = 0;
+	d = fb->snap_dirty;
+	box_clear(&fb->snap_dirty);
+	yoffset = fb->yoffset;
+	spin_unlock_irq(&fb->lock);
+
+	/* only this thread changes fb->snap */
+	old = fb->snap;
+	snap = cdata_snap_build(fb, old, &d, yoffset);
+
+	up_read(&fb->mode_sem);
+
+	spin_lock_irq(&fb->lock);
+	if (snap) {
+	    snap->info.seq = fb->snap_seq + 1;
+	    fb->snap = snap;
+	    fb->snap_ret = 0;
+	} else {
+	    /* copy those pages next time */
+	    if (!box_empty(&d))
+		box_union(&fb->snap_dirty, d.x0, d.y0, d.x1, d.y1);
+	    fb->snap_ret = -ENOMEM;
+	}
+	fb->snap_seq++;
+	spin_unlock_irq(&fb->lock);
+
+	wake_up_interruptible(&fb->snap_wq);
+
+	if (snap)
+	    cdata_snap_put(old);
+}
+
+/* ask for a snapshot and make it the file's current one */
+static int cdata_snapshot(struct cdata_t *cdata, struct cdata_snapshot *info)
+{
+	struct cdata_fb *fb = cdata->dev;
+	struct cdata_snap *snap, *prev;
+	unsigned int seq;
+	int ret;
+
+	spin_lock_irq(&fb->lock);
+	seq = fb->snap_seq;
+	fb->snap_req = 1;
+	cdata_fb_kick(fb);
+	spin_unlock_irq(&fb->lock);
+
+	if (wait_event_interruptible(fb->snap_wq, fb->snap_seq != seq))
+	    return -ERESTARTSYS;
+
+	spin_lock_irq(&fb->lock);
+	ret = fb->snap_ret;
+	snap = fb->snap;
+	if (ret == 0) {
+	    kref_get(&snap->ref);
+	    prev = cdata->snap;
+	    cdata->snap = snap;
+	    *info = snap->info;
+	}
+	spin_unlock_irq(&fb->lock);
+
+	if (ret == 0)
+	    cdata_snap_put(prev);
+
+	return ret;
+}
+
+/* the file's current snapshot, with a reference */
+static struct cdata_snap *cdata_snap_get(struct cdata_t *cdata)
+{
+	struct cdata_snap *snap;
+
+	spin_lock_irq(&cdata->dev->lock);
+	snap = cdata->snap;
+	if (snap)
+	    kref_get(&snap->ref);
+	spin_unlock_irq(&cdata->dev->lock);
+
+	return snap;
+}
+
+/*** flush *****/
+
+/* shadow row shown on row r of the visible window */
+static inline unsigned int frame_row(struct cdata_fb *fb,
+		unsigned int yoffset, unsigned int r)
+{
+	unsigned int v = yoffset + r;
+
+	if (v >= fb->yres_virtual)
+	    v -= fb->yres_virtual;
+	return v;
+}
+
+/* convert n pixels of shadow row v from x on, and copy them to panel row r */
+static void lcd_flush_row(struct cdata_fb *fb, unsigned int v,
+		unsigned int r, unsigned int x, unsigned int n)
+{
+	fb->fmt->cvt(fb->line, fb->shadow + v*fb->pitch + x*fb->fmt->bpp,
+			n, fb->pal);
+	lcd_correct(fb, fb->line, n, x, r);
+	memcpy_toio(fb->fb + r*LCD_LINE + x*LCD_BPP, fb->line, n*LCD_BPP);
+
+	/* for debug: draw row by row */
+	if (delay == 1)
+	    schedule();
+}
+
+/*
+ * rows shadow rows from v on to panel rows from r on, unrotated.  A
+ * frame already in the panel format with no correction to apply is
+ * copied straight from the shadow, and full-width rows are contiguous
+ * on both sides, so they go out as a single burst.
+ */
+static void lcd_flush_rows(struct cdata_fb *fb, unsigned int v,
+		unsigned int r, unsigned int rows, unsigned int x, unsigned int n)
+{
+	unsigned int i;
+
+	if (fb->fmt != &cdata_fmts[CDATA_FMT_XRGB8888] || fb->ctab) {
+	    for (i = 0; i < rows; i++)
+		lcd_flush_row(fb, v + i, r + i, x, n);
+	    return;
+	}
+
+	if (n == LCD_WIDTH) {
+	    memcpy_toio(fb->fb + r*LCD_LINE, fb->shadow + v*LCD_LINE,
+	    		rows*LCD_LINE);
+	} else {
+	    for (i = 0; i < rows; i++)
+		memcpy_toio(fb->fb + (r + i)*LCD_LINE + x*LCD_BPP,
+			fb->shadow + (v + i)*LCD_LINE + x*LCD_BPP,
+			n*LCD_BPP);
+	}
+
+	if (delay == 1)
+	    schedule();
+}
+
+/* the same upside down: row r goes to the bottom, mirrored */
+static void lcd_flush_row_180(struct cdata_fb *fb, unsigned int v,
+		unsigned int r, unsigned int x, unsigned int n)
+{
+	u32 *p = fb->line;
+	unsigned int i;
+
+	fb->fmt->cvt(p, fb->shadow + v*fb->pitch + x*fb->fmt->bpp, n, fb->pal);
+	for (i = 0; i < n/2; i++)
+	    swap(p[i], p[n-1-i]);
+	lcd_correct(fb, p, n, LCD_WIDTH-x-n, LCD_HEIGHT-1-r);
+	memcpy_toio(fb->fb + (LCD_HEIGHT-1-r)*LCD_LINE
+			+ (LCD_WIDTH-x-n)*LCD_BPP, p, n*LCD_BPP);
+
+	if (delay == 1)
+	    schedule();
+}
+
+/*
+ * dst[i*n + j] = src[j*w + i], an n-row by w-column tile turned on
+ * its side.  Walking it in ROT_BLOCK squares keeps the rows being read
+ * and the rows being written in a handful of cache lines each, where
+ * the plain double loop misses on every store.
+ */
+static void transpose_tile(u32 *dst, const u32 *src, unsigned int w,
+		unsigned int n)
+{
+	unsigned int bi, bj, i, j, ie, je;
+
+	for (bi = 0; bi < w; bi += ROT_BLOCK) {
+	    ie = min(bi + ROT_BLOCK, w);
+	    for (bj = 0; bj < n; bj += ROT_BLOCK) {
+		je = min(bj + ROT_BLOCK, n);
+		for (i = bi; i < ie; i++)
+		    for (j = bj; j < je; j++)
+			dst[i*n + j] = src[j*w + i];
+	    }
+	}
+}
+
+/*
+ * n visible rows from r0 on, columns x0 to x1, at 90 or 270 degrees.
+ * The band is converted into fb->tile, transposed into fb->rot, and
+ * every frame column then lands on one panel row as a single run of
+ * n pixels.  At 90 the band is stacked bottom-up so that the run
+ * comes out in panel order.
+ */
+static void lcd_flush_band(struct cdata_fb *fb, unsigned int yoffset,
+		unsigned int r0, unsigned int n, unsigned int x0, unsigned int x1)
+{
+	unsigned int w = x1 - x0;
+	unsigned int bpp = fb->fmt->bpp;
+	unsigned int i, j, t, row, col;
+
+	for (j = 0; j < n; j++) {
+	    t = fb->rotate == 90 ? n-1-j : j;
+	    fb->fmt->cvt(fb->tile + t*w,
+	    		fb->shadow + frame_row(fb, yoffset, r0 + j)*fb->pitch
+			+ x0*bpp, w, fb->pal);
+	}
+
+	transpose_tile(fb->rot, fb->tile, w, n);
+
+	for (i = 0; i < w; i++) {
+	    if (fb->rotate == 90) {
+		row = x0 + i;
+		col = fb->yres - r0 - n;
+	    } else {
+		row = fb->xres - 1 - (x0 + i);
+		col = r0;
+	    }
+	    lcd_correct(fb, fb->rot + i*n, n, col, row);
+	    memcpy_toio(fb->fb + row*LCD_LINE + col*LCD_BPP,
+	    		fb->rot + i*n, n*LCD_BPP);
+	}
+
+	if (delay == 1)
+	    schedule();
+}
+
+/* the damaged rows of the visible window, a band at a time */
+static unsigned int lcd_flush_rotated(struct cdata_fb *fb,
+		const struct cdata_box *d, unsigned int yoffset)
+{
+	unsigned int r, n, v, px = 0;
+
+	for (r = 0; r < fb->yres; r += n) {
+	    for (n = 0; n < ROT_BAND && r + n < fb->yres; n++) {
+		v = frame_row(fb, yoffset, r + n);
+		if (v < d->y0 || v >= d->y1)
+		    break;
+	    }
+	    if (!n) {
+		n = 1;
+		continue;
+	    }
+	    lcd_flush_band(fb, yoffset, r, n, d->x0, d->x1);
+	    px += n * (d->x1 - d->x0);
+	}
+
+	return px;
+}
+
+static void cdata_fb_account(struct cdata_fb *fb, ktime_t start,
+		unsigned int px, unsigned int bytes)
+{
+	struct cdata_fb_stats *st = &fb->stats;
+	ktime_t end = ktime_get();
+	u64 ns, period;
+
+	ns = ktime_to_ns(ktime_sub(end, start));
+	period = NSEC_PER_SEC / (refresh ? refresh : 60);
+
+	spin_lock_irq(&fb->lock);
+	st->frames++;
+	st->bytes += bytes;
+	st->pixels += px;
+	st->flush_ns += ns;
+	if (ns > st->flush_max_ns)
+	    st->flush_max_ns = ns;
+	st->missed += div64_u64(ktime_to_ns(end), period) -
+			div64_u64(ktime_to_ns(start), period);
+	spin_unlock_irq(&fb->lock);
+}
+
+static void cdata_fb_flush(struct cdata_fb *fb)
+{
+	struct cdata_box d;
+	unsigned int yoffset, r, v, n, i, px, bytes;
+	int repaint;
+	ktime_t start;
+
+	spin_lock_irq(&fb->lock);
+	d = fb->dirty;
+	repaint = fb->repaint;
+	yoffset = fb->yoffset;
+	box_clear(&fb->dirty);
+	fb->repaint = 0;
+	spin_unlock_irq(&fb->lock);
+
+	if (repaint) {
+	    d.x0 = d.y0 = 0;
+	    d.x1 = fb->xres;
+	    d.y1 = fb->yres_virtual;
+	}
+	if (box_empty(&d))
+	    return;
+
+	start = ktime_get();
+	px = bytes = 0;
+
+	down_read(&fb->mode_sem);
+
+	if (fb->pan && !fb->rotate) {
+	    /*
+	     * The panel memory holds the whole virtual frame and the
+	     * controller scans out from yoffset, so rows go where they
+	     * are in the shadow and panning costs nothing here.  Rows
+	     * outside the window are written but not seen, so they count
+	     * as bytes only; the window never wraps in this mode.
+	     */
+	    lcd_flush_rows(fb, d.y0, d.y0, d.y1 - d.y0, d.x0, d.x1 - d.x0);
+	    v = max(d.y0, yoffset);
+	    r = min(d.y1, yoffset + fb->yres);
+	    if (r > v)
+		px = (r - v) * (d.x1 - d.x0);
+	    bytes = (d.y1 - d.y0) * (d.x1 - d.x0) * LCD_BPP;
+	} else if (fb->rotate == 90 || fb->rotate == 270) {
+	    px = lcd_flush_rotated(fb, &d, yoffset);
+	} else {
+	    /*
+	     * Emulate the scanout base: walk the visible window only, in
+	     * runs of damaged rows that do not wrap around the frame.
+	     */
+	    for (r = 0; r < LCD_HEIGHT; r += n) {
+		v = frame_row(fb, yoffset, r);
+		if (v < d.y0 || v >= d.y1) {
+		    n = 1;
+		    continue;
+		}
+		n = min3(d.y1 - v, fb->yres_virtual - v, LCD_HEIGHT - r);
+		if (fb->rotate) {
+		    for (i = 0; i < n; i++)
+			lcd_flush_row_180(fb, v + i, r + i, d.x0, d.x1 - d.x0);
+		} else {
+		    lcd_flush_rows(fb, v, r, n, d.x0, d.x1 - d.x0);
+		}
+		px += n * (d.x1 - d.x0);
+	    }
+	}
+
+	up_read(&fb->mode_sem);
+
+	if (!bytes)
+	    bytes = px*LCD_BPP;
+	if (bytes)
+	    cdata_fb_account(fb, start, px, bytes);
+}
+
+static int cdata_compositor(void *priv)
+{
+	struct cdata_fb *fb = (struct cdata_fb *)priv;
+
+	while (!kthread_should_stop()) {
+	    wait_event_interruptible(fb->wq,
+	    		fb->pending || kthread_should_stop());
+
+	    spin_lock_irq(&fb->lock);
+	    fb->pending = 0;
+	    spin_unlock_irq(&fb->lock);
+
+	    cdata_fb_compose(fb);
+	    if (fb->snap_req)
+		cdata_fb_snapshot(fb);
+	    cdata_fb_flush(fb);
+	}
+
+	return 0;
+}
+
+/*** panning *****/
+
+static int s3c2410_pan(struct cdata_fb *fb, unsigned int yoffset)
+{
+	unsigned long start = LCD_PHYS + yoffset*LCD_LINE;
+	unsigned long end = start + LCD_HEIGHT*LCD_LINE;
+
+	/* LCDBANK is A[30:22], LCDBASEU and LCDBASEL are A[21:1] */
+	writel((((start >> 22) & 0x1ff) << 21) | ((start >> 1) & 0x1fffff),
+		fb->regs + S3C2410_LCDSADDR1);
+	writel((end >> 1) & 0x1fffff, fb->regs + S3C2410_LCDSADDR2);
+
+	return 0;
+}
+
+static int cdata_fb_pan(struct cdata_fb *fb, unsigned int yoffset)
+{
+	int ret = 0;
+
+	down_read(&fb->mode_sem);
+
+	if (yoffset >= fb->yres_virtual) {
+	    ret = -EINVAL;
+	    goto out;
+	}
+
+	/* a rotated frame is no longer in scanout order */
+	if (fb->pan && !fb->rotate) {
+	    /* the controller cannot wrap around the end of the frame */
+	    if (yoffset + LCD_HEIGHT > fb->yres_virtual) {
+		ret = -EINVAL;
+		goto out;
+	    }
+	    ret = fb->pan(fb, yoffset);
+	    if (ret)
+		goto out;
+	    spin_lock_irq(&fb->lock);
+	    fb->yoffset = yoffset;
+	    spin_unlock_irq(&fb->lock);
+	    goto out;
+	}
+
+	spin_lock_irq(&fb->lock);
+	fb->yoffset = yoffset;
+	fb->repaint = 1;
+	cdata_fb_kick(fb);
+	spin_unlock_irq(&fb->lock);
+
+out:
+	up_read(&fb->mode_sem);
+	return ret;
+}
+
+static void cdata_fb_set_format(struct cdata_fb *fb, struct cdata_fmt *fmt)
+{
+	struct cdata_layer *l;
+
+	down_write(&fb->mode_sem);
+	fb->fmt = fmt;
+	fb->pitch = fb->xres*fmt->bpp;
+	memset(fb->shadow, 0, LCD_LINE*fb->rows);
+	list_for_each_entry(l, &fb->layers, list)
+	    memset(l->buf, 0, l->w*l->h*LCD_BPP);
+	up_write(&fb->mode_sem);
+
+	spin_lock_irq(&fb->lock);
+	fb->repaint = 1;
+	box_union(&fb->snap_dirty, 0, 0, fb->xres, fb->yres_virtual);
+	cdata_fb_kick(fb);
+	spin_unlock_irq(&fb->lock);
+}
+
+/*
+ * The frame holds palette indices, so a new palette only needs the
+ * visible window expanded again.  Flushes read fb->pal under mode_sem.
+ */
+static int cdata_fb_set_palette(struct cdata_fb *fb,
+		const struct cdata_palette *p)
+{
+	unsigned int i;
+	int c8;
+
+	if (p->start >= 256 || p->count > 256 - p->start)
+	    return -EINVAL;
+
+	down_write(&fb->mode_sem);
+	for (i = 0; i < p->count; i++)
+	    fb->pal[p->start + i] = p->color[i] & 0xffffff;
+	c8 = fb->fmt == &cdata_fmts[CDATA_FMT_C8];
+	up_write(&fb->mode_sem);
+
+	if (c8) {
+	    spin_lock_irq(&fb->lock);
+	    fb->repaint = 1;
+	    cdata_fb_kick(fb);
+	    spin_unlock_irq(&fb->lock);
+	}
+
+	return 0;
+}
+
+/* calibration only changes the way out, so the frame is flushed again */
+static int cdata_fb_set_correction(struct cdata_fb *fb,
+		const struct cdata_correction *c)
+{
+	u8 (*ctab)[3][256] = NULL;
+	u8 (*old)[3][256];
+
+	if (c->flags & ~(CDATA_CORR_LUT | CDATA_CORR_DITHER))
+	    return -EINVAL;
+	if ((c->flags & CDATA_CORR_DITHER) &&
+	    (c->dither_bits < 1 || c->dither_bits > 8))
+	    return -EINVAL;
+
+	if (c->flags) {
+	    ctab = cdata_ctab_build(c);
+	    if (!ctab)
+		return -ENOMEM;
+	}
+
+	down_write(&fb->mode_sem);
+	old = fb->ctab;
+	fb->ctab = ctab;
+	fb->corr = c->flags;
+	fb->dither_step = (c->flags & CDATA_CORR_DITHER) ?
+				1 << (8 - c->dither_bits) : 1;
+	up_write(&fb->mode_sem);
+
+	kfree(old);
+
+	spin_lock_irq(&fb->lock);
+	fb->repaint = 1;
+	cdata_fb_kick(fb);
+	spin_unlock_irq(&fb->lock);
+
+	return 0;
+}
+
+/*
+ * The shadow keeps its size, so a frame on its side gets fewer, longer
+ * rows.  Layers keep their contents and are composed again; whatever
+ * no longer fits the frame is clipped.
+ */
+static int cdata_fb_set_rotate(struct cdata_fb *fb, unsigned int rotate)
+{
+	struct cdata_layer *l;
+
+	if (rotate != 0 && rotate != 90 && rotate != 180 && rotate != 270)
+	    return -EINVAL;
+
+	down_write(&fb->mode_sem);
+
+	fb->rotate = rotate;
+	if (rotate == 90 || rotate == 270) {
+	    fb->xres = LCD_HEIGHT;
+	    fb->yres = LCD_WIDTH;
+	} else {
+	    fb->xres = LCD_WIDTH;
+	    fb->yres = LCD_HEIGHT;
+	}
+	fb->yres_virtual = LCD_WIDTH*fb->rows / fb->xres;
+	fb->pitch = fb->xres*fb->fmt->bpp;
+	memset(fb->shadow, 0, LCD_LINE*fb->rows);
+
+	/* scan out from the top again, the flush path emulates panning */
+	if (fb->pan)
+	    fb->pan(fb, 0);
+
+	spin_lock_irq(&fb->lock);
+	fb->yoffset = 0;
+	fb->repaint = 1;
+	box_union(&fb->snap_dirty, 0, 0, fb->xres, fb->yres_virtual);
+	list_for_each_entry(l, &fb->layers, list)
+	    box_union(&l->dirty, 0, 0, l->w, l->h);
+	cdata_fb_kick(fb);
+	spin_unlock_irq(&fb->lock);
+
+	up_write(&fb->mode_sem);
+
+	return 0;
+}
+
+/*** layers *****/
+
+/* above every layer with the same or a lower z; mode_sem held for write */
+static void cdata_layer_insert(struct cdata_fb *fb, struct cdata_layer *l)
+{
+	struct cdata_layer *pos;
+
+	list_for_each_entry(pos, &fb->layers, list) {
+	    if (pos->z > l->z)
+		break;
+	}
+	list_add_tail(&l->list, &pos->list);
+}
+
+static int cdata_layer_set(struct cdata_fb *fb, struct cdata_layer *l,
+		const struct cdata_layer_info *info)
+{
+	unsigned char *buf = NULL;
+	int x, y, w, h;
+
+	if (!info->w || !info->h || info->w > fb->xres ||
+	    info->h > fb->yres_virtual || info->alpha > 255)
+	    return -EINVAL;
+
+	/* at most fully off screen, so x + w and y + h cannot overflow */
+	if (info->x < -(int)info->w || info->x > (int)fb->xres ||
+	    info->y < -(int)info->h || info->y > (int)fb->yres_virtual)
+	    return -EINVAL;
+
+	if (info->w != l->w || info->h != l->h) {
+	    buf = vmalloc_user(info->w*info->h*LCD_BPP);
+	    if (!buf)
+		return -ENOMEM;
+	}
+
+	down_write(&fb->mode_sem);
+
+	/* userspace still has the old buffer mapped */
+	if (buf && atomic_read(&l->mapped)) {
+	    up_write(&fb->mode_sem);
+	    vfree(buf);
+	    return -EBUSY;
+	}
+
+	x = l->x;
+	y = l->y;
+	w = l->w;
+	h = l->h;
+
+	if (buf) {
+	    vfree(l->buf);
+	    l->buf = buf;
+	    l->w = info->w;
+	    l->h = info->h;
+	}
+	l->x = info->x;
+	l->y = info->y;
+	l->z = info->z;
+	l->alpha = info->alpha;
+
+	list_del(&l->list);
+	cdata_layer_insert(fb, l);
+
+	up_write(&fb->mode_sem);
+
+	/* where it was and where it is now; a hidden layer stays hidden */
+	cdata_fb_damage(fb, x, y, x + w, y + h);
+	if (l->shown)
+	    cdata_layer_damage(fb, l, 0, 0, info->w, info->h);
+	else
+	    cdata_fb_damage(fb, info->x, info->y,
+	    		info->x + info->w, info->y + info->h);
+
+	return 0;
+}
+
+/* clip w x h at (x, y) to the layer, 0 if nothing is left */
+static int layer_clip(struct cdata_layer *l, unsigned int x, unsigned int y,
+		unsigned int *w, unsigned int *h)
+{
+	if (x >= l->w || y >= l->h || !*w || !*h)
+	    return 0;
+	if (*w > l->w - x)
+	    *w = l->w - x;
+	if (*h > l->h - y)
+	    *h = l->h - y;
+	return 1;
+}
+
+/*** text *****/
+
+#define	M(b)	((b) ? 0xffffffff : 0)
+#define	NIB(n)	{ M((n) & 8), M((n) & 4), M((n) & 2), M((n) & 1) }
+
+/* which of four pixels a nibble of glyph bits covers */
+static const u32 nibble_mask[16][4] = {
+	NIB(0), NIB(1), NIB(2), NIB(3), NIB(4), NIB(5), NIB(6), NIB(7),
+	NIB(8), NIB(9), NIB(10), NIB(11), NIB(12), NIB(13), NIB(14), NIB(15),
+};
+
+#undef	NIB
+#undef	M
+
+/*
+ * Expand w bits, MSB first, into 32bpp pixels.  Four pixels come out
+ * of each table lookup with no branch on the bits themselves.
+ */
+static void expand_row32(u32 *dst, u32 bits, unsigned int w,
+		u32 fg, u32 bg, int opaque)
+{
+	const u32 *m;
+	unsigned int i, k;
+
+	for (i = 0; i + 4 <= w; i += 4, bits <<= 4) {
+	    m = nibble_mask[bits >> 28];
+	    if (opaque) {
+		dst[i] = (fg & m[0]) | (bg & ~m[0]);
+		dst[i+1] = (fg & m[1]) | (bg & ~m[1]);
+		dst[i+2] = (fg & m[2]) | (bg & ~m[2]);
+		dst[i+3] = (fg & m[3]) | (bg & ~m[3]);
+	    } else {
+		dst[i] = (dst[i] & ~m[0]) | (fg & m[0]);
+		dst[i+1] = (dst[i+1] & ~m[1]) | (fg & m[1]);
+		dst[i+2] = (dst[i+2] & ~m[2]) | (fg & m[2]);
+		dst[i+3] = (dst[i+3] & ~m[3]) | (fg & m[3]);
+	    }
+	}
+
+	m = nibble_mask[bits >> 28];
+	for (k = 0; i < w; i++, k++) {
+	    if (opaque)
+		dst[i] = (fg & m[k]) | (bg & ~m[k]);
+	    else
+		dst[i] = (dst[i] & ~m[k]) | (fg & m[k]);
+	}
+}
+
+/* the same for the narrower formats, a pixel at a time */
+static void expand_row(u8 *dst, unsigned int bpp, u32 bits, unsigned int w,
+		u32 fg, u32 bg, int opaque)
+{
+	unsigned int i;
+
+	for (i = 0; i < w; i++, bits <<= 1, dst += bpp) {
+	    if (bits & 0x80000000)
+		fill_span(dst, bpp, fg, 1);
+	    else if (opaque)
+		fill_span(dst, bpp, bg, 1);
+	}
+}
+
+/* glyph g at (x, y) of the layer, colours packed, mode_sem held */
+static void glyph_draw(struct cdata_layer *l, unsigned int bpp,
+		const struct cdata_font *font, unsigned int g,
+		unsigned int x, unsigned int y, u32 fg, u32 bg, int opaque,
+		struct cdata_box *d)
+{
+	unsigned int w, h, r;
+	const u32 *bits;
+	u8 *p;
+
+	if (!font || g >= font->count)
+	    return;
+
+	w = font->width;
+	h = font->height;
+	if (!layer_clip(l, x, y, &w, &h))
+	    return;
+
+	bits = font->bits + g*font->height;
+	p = l->buf + (y*l->w + x)*bpp;
+
+	for (r = 0; r < h; r++, p += l->w*bpp) {
+	    if (bpp == 4)
+		expand_row32((u32 *)p, bits[r], w, fg, bg, opaque);
+	    else
+		expand_row(p, bpp, bits[r], w, fg, bg, opaque);
+	}
+
+	box_union(d, x, y, x + w, y + h);
+}
+
+static void cdata_font_free(struct cdata_font *font)
+{
+	if (font) {
+	    vfree(font->bits);
+	    kfree(font);
+	}
+}
+
+static int cdata_set_atlas(struct cdata_t *cdata, const struct cdata_atlas *ua)
+{
+	struct cdata_fb *fb = cdata->dev;
+	struct cdata_font *font, *old;
+	unsigned int stride, n, i, b;
+	u8 *tmp, *row;
+	int ret = -ENOMEM;
+
+	if (!ua->width || ua->width > 32 || !ua->height ||
+	    ua->height > FONT_MAX_HEIGHT || !ua->count ||
+	    ua->count > FONT_MAX_GLYPHS)
+	    return -EINVAL;
+
+	stride = (ua->width + 7) / 8;
+	n = ua->count * ua->height;
+
+	font = kzalloc(sizeof(struct cdata_font), GFP_KERNEL);
+	tmp = vmalloc(n*stride);
+	if (!font || !tmp)
+	    goto fail;
+	font->bits = vmalloc(n*sizeof(u32));
+	if (!font->bits)
+	    goto fail;
+
+	ret = -EFAULT;
+	if (copy_from_user(tmp, (const u8 __user *)ua->bits, n*stride))
+	    goto fail;
+
+	for (i = 0, row = tmp; i < n; i++, row += stride) {
+	    font->bits[i] = 0;
+	    for (b = 0; b < stride; b++)
+		font->bits[i] |= row[b] << (24 - 8*b);
+	}
+	vfree(tmp);
+
+	font->width = ua->width;
+	font->height = ua->height;
+	font->count = ua->count;
+
+	down_write(&fb->mode_sem);
+	old = cdata->font;
+	cdata->font = font;
+	up_write(&fb->mode_sem);
+
+	cdata_font_free(old);
+
+	return 0;
+
+fail:
+	vfree(tmp);
+	cdata_font_free(font);
+	return ret;
+}
+
+#define	TEXT_CHUNK	(16)
+
+/* draw a user array of glyphs, packing colours only when they change */
+static int cdata_text(struct cdata_t *cdata, const struct cdata_text *t)
+{
+	struct cdata_fb *fb = cdata->dev;
+	struct cdata_layer *l = &cdata->layer;
+	const struct cdata_glyph __user *ug;
+	struct cdata_glyph g[TEXT_CHUNK];
+	struct cdata_box d;
+	unsigned int done, n, i, bpp;
+	u32 xfg = 0, xbg = 0, fg = 0, bg = 0;
+	int have_fg = 0, have_bg = 0;	/* fg, bg hold xfg, xbg */
+	int ret = 0;
+
+	box_clear(&d);
+	ug = (const struct cdata_glyph __user *)t->glyphs;
+
+	down_read(&fb->mode_sem);
+
+	if (!cdata->font) {
+	    ret = -ENXIO;
+	    goto out;
+	}
+
+	bpp = fb->fmt->bpp;
+
+	for (done = 0; done < t->count; done += n) {
+	    n = min_t(unsigned int, t->count - done, TEXT_CHUNK);
+	    if (copy_from_user(g, ug + done, n*sizeof(struct cdata_glyph))) {
+		ret = -EFAULT;
+		break;
+	    }
+
+	    for (i = 0; i < n; i++) {
+		if (!have_fg || g[i].fg != xfg) {
+		    xfg = g[i].fg;
+		    fg = fb->fmt->pack(xfg & 0xffffff, fb->pal);
+		    have_fg = 1;
+		}
+		if (g[i].bg != CDATA_TRANSPARENT &&
+		    (!have_bg || g[i].bg != xbg)) {
+		    xbg = g[i].bg;
+		    bg = fb->fmt->pack(xbg & 0xffffff, fb->pal);
+		    have_bg = 1;
+		}
+		glyph_draw(l, bpp, cdata->font, g[i].index, g[i].x, g[i].y,
+				fg, bg, g[i].bg != CDATA_TRANSPARENT, &d);
+	    }
+	}
+
+	if (!box_empty(&d))
+	    cdata_layer_damage(fb, l, d.x0, d.y0, d.x1, d.y1);
+
+out:
+	up_read(&fb->mode_sem);
+
+	return ret;
+}
+
+/*** command ring *****/
+
+static void cmd_fill(struct cdata_layer *l, unsigned int bpp,
+		const struct cdata_cmd *cmd, u32 c, struct cdata_box *d)
+{
+	unsigned int w = cmd->w, h = cmd->h, y;
+
+	if (!layer_clip(l, cmd->x, cmd->y, &w, &h))
+	    return;
+
+	for (y = cmd->y; y < cmd->y + h; y++)
+	    fill_span(l->buf + (y*l->w + cmd->x)*bpp, bpp, c, w);
+
+	box_union(d, cmd->x, cmd->y, cmd->x + w, cmd->y + h);
+}
+
+static void cmd_copy(struct cdata_layer *l, unsigned int bpp,
+		const struct cdata_cmd *cmd, struct cdata_box *d)
+{
+	unsigned int w = cmd->w, h = cmd->h, pitch = l->w*bpp, i;
+	u8 *src, *dst;
+
+	if (!layer_clip(l, cmd->x, cmd->y, &w, &h) ||
+	    !layer_clip(l, cmd->sx, cmd->sy, &w, &h))
+	    return;
+
+	src = l->buf + (cmd->sy*l->w + cmd->sx)*bpp;
+	dst = l->buf + (cmd->y*l->w + cmd->x)*bpp;
+
+	/* rows bottom-up when moving down, so overlap is safe either way */
+	if (cmd->y > cmd->sy) {
+	    for (i = h; i-- > 0; )
+		memmove(dst + i*pitch, src + i*pitch, w*bpp);
+	} else {
+	    for (i = 0; i < h; i++)
+		memmove(dst + i*pitch, src + i*pitch, w*bpp);
+	}
+
+	box_union(d, cmd->x, cmd->y, cmd->x + w, cmd->y + h);
+}
+
+/* Bresenham, clipped a pixel at a time */
+static void cmd_line(struct cdata_layer *l, unsigned int bpp,
+		const struct cdata_cmd *cmd, u32 c, struct cdata_box *d)
+{
+	int x = cmd->x, y = cmd->y;
+	int x1 = cmd->w, y1 = cmd->h;
+	int dx = abs(x1 - x), sx = x < x1 ? 1 : -1;
+	int dy = -abs(y1 - y), sy = y < y1 ? 1 : -1;
+	int err = dx + dy, e2;
+
+	for (;;) {
+	    if (x < l->w && y < l->h) {
+		fill_span(l->buf + (y*l->w + x)*bpp, bpp, c, 1);
+		box_union(d, x, y, x + 1, y + 1);
+	    }
+	    if (x == x1 && y == y1)
+		break;
+	    e2 = 2*err;
+	    if (e2 >= dy) {
+		err += dy;
+		x += sx;
+	    }
+	    if (e2 <= dx) {
+		err += dx;
+		y += sy;
+	    }
+	}
+}
 
-#include "cdata_ioctl.h"
+/*
+ * Run the ring from head up to the last doorbell against the file's
+ * layer.  Each command is copied out of the shared page before it is
+ * looked at, so the client cannot change it under us; colours are
+ * packed once per run of the same colour, which matters for C8.
+ */
+static void cdata_ring_run(struct work_struct *work)
+{
+	struct cdata_t *cdata = container_of(work, struct cdata_t, ring_work);
+	struct cdata_fb *fb = cdata->dev;
+	struct cdata_layer *l = &cdata->layer;
+	struct cdata_ring *ring = cdata->ring;
+	struct cdata_cmd cmd;
+	struct cdata_box d;
+	unsigned int head, tail, bpp, errors = 0;
+	u32 xrgb = 0, c = 0;
+	int packed = 0;		/* c holds xrgb */
 
-#define	LCD_WIDTH	(240)
-#define	LCD_HEIGHT	(320)
-#define	LCD_BPP		(4)
-#define	LCD_LENGTH	(LCD_WIDTH*LCD_HEIGHT*LCD_BPP)
-#define	LCD_SIZE	(LCD_WIDTH*LCD_HEIGHT)
+	box_clear(&d);
 
-#define	BUF_LENGTH	(16384)
+	down_read(&fb->mode_sem);
 
-struct cdata_t {
-	unsigned char 	*fb;		/* base address */
-	unsigned int 	fb_cur;		/* current pixel */
-	unsigned char	*buf;	
-	unsigned int	buf_idx;	/* buffer index */	
-	
-	wait_queue_head_t	wq;
+	bpp = fb->fmt->bpp;
+	/* never ring->head: the client can write it */
+	head = cdata->ring_head;
+	tail = ACCESS_ONCE(cdata->ring_tail);
 
-	struct timer_list 	timer;
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,0)
-	struct work_struct	work;	// 2.6
-#else
-	struct tq_struct	tq;	// 2.4
-#endif
-	struct semaphore sem_wait;
-};
+	for (; head != tail; head++) {
+	    memcpy(&cmd, &ring->cmd[head % CDATA_RING_ENTRIES], sizeof(cmd));
 
-static void lcd_write(void *);
+	    if ((cmd.op == CDATA_CMD_FILL || cmd.op == CDATA_CMD_LINE ||
+	         cmd.op == CDATA_CMD_GLYPH) && (!packed || cmd.color != xrgb)) {
+		xrgb = cmd.color;
+		c = fb->fmt->pack(xrgb & 0xffffff, fb->pal);
+		packed = 1;
+	    }
 
-#ifndef	MODULE
-static int 	delay;
-/**
- * cdata=x,y
- */
-int __init cdata_setup(char *str)
+	    switch (cmd.op) {
+	    case CDATA_CMD_NOP:
+		break;
+	    case CDATA_CMD_FILL:
+		cmd_fill(l, bpp, &cmd, c, &d);
+		break;
+	    case CDATA_CMD_COPY:
+		cmd_copy(l, bpp, &cmd, &d);
+		break;
+	    case CDATA_CMD_LINE:
+		cmd_line(l, bpp, &cmd, c, &d);
+		break;
+	    case CDATA_CMD_GLYPH:
+		glyph_draw(l, bpp, cdata->font, cmd.sx, cmd.x, cmd.y,
+				c, 0, 0, &d);
+		break;
+	    default:
+		errors++;
+	    }
+	}
+
+	/* one update for the whole batch */
+	if (!box_empty(&d))
+	    cdata_layer_damage(fb, l, d.x0, d.y0, d.x1, d.y1);
+
+	up_read(&fb->mode_sem);
+
+	ACCESS_ONCE(cdata->ring_head) = head;
+
+	smp_wmb();
+	ring->error += errors;
+	ring->head = head;
+}
+
+static int cdata_ring_submit(struct cdata_t *cdata,
+		const struct cdata_submit *sub)
 {
-	int ints[2];
+	int ret = 0;
 
-	str = get_options(str, ARRAY_SIZE(ints), ints);
+	mutex_lock(&cdata->ring_lock);
 
-	if (ints[0] == 1)
-	    delay = 1;
-	return 0;
+	if (!cdata->ring) {
+	    ret = -ENXIO;
+	    goto out;
+	}
+
+	/* at most one ring's worth ahead of what has run */
+	if (sub->tail - ACCESS_ONCE(cdata->ring_head) > CDATA_RING_ENTRIES ||
+	    sub->tail - cdata->ring_tail > CDATA_RING_ENTRIES) {
+	    ret = -EINVAL;
+	    goto out;
+	}
+
+	cdata->ring_tail = sub->tail;
+	schedule_work(&cdata->ring_work);
+
+out:
+	mutex_unlock(&cdata->ring_lock);
+
+	if (ret == 0 && (sub->flags & CDATA_SUBMIT_WAIT))
+	    flush_work(&cdata->ring_work);
+
+	return ret;
 }
 
-__setup("cdata=", cdata_setup);
-#endif
+static int cdata_ring_mmap(struct cdata_t *cdata, struct vm_area_struct *vma)
+{
+	int ret;
+
+	if (vma->vm_pgoff != (CDATA_RING_OFFSET >> PAGE_SHIFT))
+	    return -EINVAL;
+
+	mutex_lock(&cdata->ring_lock);
+	if (!cdata->ring) {
+	    cdata->ring = vmalloc_user(sizeof(struct cdata_ring));
+	    if (!cdata->ring) {
+		mutex_unlock(&cdata->ring_lock);
+		return -ENOMEM;
+	    }
+	}
+	ret = remap_vmalloc_range(vma, cdata->ring, 0);
+	mutex_unlock(&cdata->ring_lock);
+
+	return ret;
+}
 
 /*** I/O wrapper functions *****/
 
 /**
- * TODO must be reentrant
+ * Every open gets its own layer, the size of the frame and hidden
+ * until the client first draws into it.
  */
 static int cdata_open(struct inode *inode, struct file *filp)
 {
-	unsigned int n;
+	struct cdata_fb *fb = cdata_fb;
 	struct cdata_t *cdata;
+	struct cdata_layer *l;
+	unsigned int n;
 
-#if 0
-	/* TODO reentrancy */
- 	if (cdata_u_count && 
-   	   (cdata_u_owner != current->uid) && /* allow user */
-   	   (cdata_u_owner != current->euid)) /* allow su */
-     	        return -EBUSY;  
- 	}
-
- 	if (cdata_u_count != 0) return -1;
+	cdata = (struct cdata_t *)
+			kzalloc(sizeof(struct cdata_t), GFP_KERNEL);
+	if (!cdata)
+	    return -ENOMEM;
 
- 	if (cdata_u_count == 0)
-   	    cdata_u_owner = current->uid;
- 	cdata_u_count++;
-#endif
+	l = &cdata->layer;
+	l->w = fb->xres;
+	l->h = fb->yres_virtual;
+	l->alpha = 255;
+	box_clear(&l->dirty);
 
-	cdata = (struct cdata_t *)
-			kmalloc(sizeof(struct cdata_t), GFP_KERNEL);
-	cdata->buf = (unsigned char *)
-			kmalloc(BUF_LENGTH, GFP_KERNEL);
+	l->buf = vmalloc_user(l->w*l->h*LCD_BPP);
+	if (!l->buf) {
+	    kfree(cdata);
+	    return -ENOMEM;
+	}
 
 	n = MINOR(inode->i_rdev);
 
 	printk(KERN_ALERT "cdata: cdata_open\n");
 	printk(KERN_ALERT "cdata: minor = %d\n", n);
 
-        /* draw LCD panel at 0x33F00000 */
-	cdata->fb = ioremap(0x33f00000, LCD_LENGTH);
-	cdata->fb_cur = 0;
-	cdata->buf_idx = 0;	// empty buffer
+	cdata->dev = fb;
+	mutex_init(&cdata->ring_lock);
+	INIT_WORK(&cdata->ring_work, cdata_ring_run);
 
-	init_waitqueue_head(&cdata->wq);
-
-	init_timer(&cdata->timer);
-
-	//INIT_TQUEUE(&cdata->tq, lcd_write, (void *)cdata);
-	INIT_WORK(&cdata->work, lcd_write);
+	down_write(&fb->mode_sem);
+	cdata_layer_insert(fb, l);
+	up_write(&fb->mode_sem);
 
 	filp->private_data = (void *)cdata;
 
@@ -121,196 +1898,856 @@ static int cdata_open(struct inode *inode, struct file *filp)
 static int cdata_close(struct inode *inode, struct file *filp)
 {
 	struct	cdata_t	*cdata = (struct cdata_t *)filp->private_data;
+	struct	cdata_fb *fb = cdata->dev;
+	struct	cdata_layer *l = &cdata->layer;
 
-	kfree(cdata->buf);
-	kfree(cdata);
+	down_write(&fb->mode_sem);
+	list_del(&l->list);
+	up_write(&fb->mode_sem);
+
+	if (l->shown)
+	    cdata_fb_damage(fb, l->x, l->y, l->x + l->w, l->y + l->h);
 
-	del_timer(&cdata->timer);
+	cancel_work_sync(&cdata->ring_work);
+	vfree(cdata->ring);
+	cdata_font_free(cdata->font);
+
+	cdata_snap_put(cdata->snap);
+	vfree(l->buf);
+	kfree(cdata);
 
 	return 0;
 }
 
-/* is it reentrant code ? */
-static void lcd_write(void * priv)
+#define	WRITE_CHUNK	(PAGE_SIZE)
+
+/* 1 if the n bytes differ; a and b share their cache line alignment */
+static inline int line_differs(const u8 *a, const u8 *b, unsigned int n)
 {
-	struct	cdata_t	*cdata = (struct cdata_t *)priv;
-	int i, n;
-	unsigned char *buf;
-	unsigned char *fb;
-	unsigned int fb_cur;
-	int j;
-
-	//n = cdata->buf_idx;
-	buf = cdata->buf;
-	fb = cdata->fb;
-	fb_cur = cdata->fb_cur;
-
-	for (i = 0; i < BUF_LENGTH; i++) {
-	    writeb(buf[i], fb+fb_cur);
-	    fb_cur++;
-
-	    if (fb_cur >= LCD_LENGTH)
-		fb_cur = 0;
-
-	    /* for debug */
-	    if (delay == 1) {
-	        schedule();
-	        for (j = 0; j < 10000; j++)
-		    ;
+	const unsigned long *x = (const unsigned long *)a;
+	const unsigned long *y = (const unsigned long *)b;
+	unsigned long d = 0;
+	unsigned int i;
+
+	if (n != L1_CACHE_BYTES)
+	    return memcmp(a, b, n) != 0;
+
+	/* a whole line: no early exit, the loads are already paid for */
+	for (i = 0; i < L1_CACHE_BYTES/sizeof(long); i += 4)
+	    d |= (x[i] ^ y[i]) | (x[i+1] ^ y[i+1]) |
+	    	 (x[i+2] ^ y[i+2]) | (x[i+3] ^ y[i+3]);
+
+	return d != 0;
+}
+
+/*
+ * Copy len bytes into the layer at pos, but only the cache lines that
+ * differ, and add them to d.  Runs of changed lines are merged before
+ * they are turned into rows.  Returns the bytes that changed.
+ */
+static unsigned int layer_write_changed(struct cdata_layer *l,
+		unsigned int bpp, unsigned int pos, const u8 *src,
+		unsigned int len, struct cdata_box *d)
+{
+	u8 *dst = l->buf + pos;
+	unsigned int off, n, run = 0, start = 0, changed = 0;
+
+	for (off = 0; off < len; off += n) {
+	    n = min_t(unsigned int, len - off,
+	    		L1_CACHE_BYTES - ((pos + off) & (L1_CACHE_BYTES-1)));
+
+	    if (line_differs(dst + off, src + off, n)) {
+		memcpy(dst + off, src + off, n);
+		if (!run)
+		    start = off;
+		run += n;
+		continue;
 	    }
+
+	    span_box(l, bpp, pos + start, run, d);
+	    changed += run;
+	    run = 0;
 	}
 
-	cdata->buf_idx = 0;
-	cdata->fb_cur = fb_cur;
+	span_box(l, bpp, pos + start, run, d);
 
-	wake_up(&cdata->wq);
+	return changed + run;
 }
 
-static ssize_t cdata_write(struct file *filp, const char *buf, 
+/*
+ * Data goes into the file's layer at the file position, or at the
+ * pwrite() offset, and stops at the end of the layer; the compositor
+ * picks it up later.  Nothing here is serialized per file, so threads
+ * can pwrite() disjoint parts of a layer at the same time.  Clients that write
+ * whole frames mostly rewrite what is already there, so every chunk
+ * is compared with the layer first and only what changed is copied
+ * and flushed.  The compare sees the chunk at the layer's alignment.
+ */
+static ssize_t cdata_write(struct file *filp, const char __user *buf,
 			size_t size, loff_t *off)
 {
 	struct	cdata_t	*cdata = (struct cdata_t *)filp->private_data;
-	unsigned int idx;
-	int i;
-	DECLARE_WAITQUEUE(wait, current);
-
-	down(&cdata->sem_wait);
-	idx = cdata->buf_idx;
-	up(&cdata->sem_wait);
-
-	for (i = 0; i < size; i++) {
-	    if (idx >= BUF_LENGTH) {
-		//cdata->buf_idx = idx;
-
-		//schedule_task(&cdata->tq); 
-		queue_work(&cdata->work);
-
-		/* blocking io */
-		spin_lock();
-		 add_wait_queue(&cdata->wq, &wait);
-		current->state = TASK_UNTERRUPTIBLE;
-		spin_unlock();
-		schedule();
-		//interruptible_sleep_on(&cdata->wq); 
-
-		//idx = cdata->buf_idx;
+	struct	cdata_fb *fb = cdata->dev;
+	struct	cdata_layer *l = &cdata->layer;
+	unsigned int pos, len, lsize, bpp, skew, changed = 0;
+	struct	cdata_box d;
+	size_t done = 0;
+	ssize_t ret = 0;
+	u8 *tmp;
+
+	tmp = kmalloc(WRITE_CHUNK + L1_CACHE_BYTES, GFP_KERNEL);
+	if (!tmp)
+	    return -ENOMEM;
+
+	box_clear(&d);
+
+	down_read(&fb->mode_sem);
+
+	bpp = fb->fmt->bpp;
+	lsize = l->w * l->h * bpp;
+
+	/* like a full disk: nothing past the end, a short write up to it */
+	if (*off >= lsize) {
+	    ret = size ? -ENOSPC : 0;
+	    goto out;
+	}
+	pos = *off;
+	if (size > lsize - pos)
+	    size = lsize - pos;
+
+	while (done < size) {
+	    len = min_t(size_t, lsize - pos, size - done);
+	    if (len > WRITE_CHUNK)
+		len = WRITE_CHUNK;
+
+	    skew = pos & (L1_CACHE_BYTES-1);
+	    if (copy_from_user(tmp + skew, buf + done, len)) {
+		ret = -EFAULT;
+		break;
+	    }
+
+	    /* a hidden layer has to show up even if it wrote zeroes */
+	    if (l->shown) {
+		changed += layer_write_changed(l, bpp, pos, tmp + skew,
+						len, &d);
+	    } else {
+		memcpy(l->buf + pos, tmp + skew, len);
+		span_box(l, bpp, pos, len, &d);
+		changed += len;
 	    }
-	    copy_from_user(&cdata->buf[idx++], &buf[i], 1); // FIXME
+
+	    done += len;
+	    pos += len;
 	}
 
-	down(&cdata->sem_wait);
-	cdata->buf_idx = idx;
-	up(&cdata->sem_wait);
+	*off = pos;
 
-	return 0;
+	if (!box_empty(&d))
+	    cdata_layer_damage(fb, l, d.x0, d.y0, d.x1, d.y1);
+
+out:
+	up_read(&fb->mode_sem);
+
+	spin_lock_irq(&fb->lock);
+	fb->stats.written += done;
+	fb->stats.changed += changed;
+	spin_unlock_irq(&fb->lock);
+
+	kfree(tmp);
+
+	return done ? done : ret;
+}
+
+/* positions are bytes into the layer, SEEK_END is its end */
+static loff_t cdata_llseek(struct file *filp, loff_t off, int whence)
+{
+	struct	cdata_t	*cdata = (struct cdata_t *)filp->private_data;
+	struct	cdata_fb *fb = cdata->dev;
+	struct	cdata_layer *l = &cdata->layer;
+
+	switch (whence) {
+	    case SEEK_SET:
+			break;
+	    case SEEK_CUR:
+			off += filp->f_pos;
+			break;
+	    case SEEK_END:
+			down_read(&fb->mode_sem);
+			off += l->w * l->h * fb->fmt->bpp;
+			up_read(&fb->mode_sem);
+			break;
+	    default:
+			return -EINVAL;
+	}
+
+	if (off < 0)
+	    return -EINVAL;
+
+	filp->f_pos = off;
+
+	return off;
+}
+
+/* read back the file's snapshot, page by page */
+static ssize_t cdata_read(struct file *filp, char __user *buf,
+			size_t size, loff_t *off)
+{
+	struct	cdata_t	*cdata = (struct cdata_t *)filp->private_data;
+	struct	cdata_snap *snap;
+	unsigned int pos, n;
+	size_t done = 0;
+	ssize_t ret = 0;
+
+	snap = cdata_snap_get(cdata);
+	if (!snap)
+	    return -ENODATA;
+
+	if (*off >= snap->info.size)
+	    goto out;
+	if (size > snap->info.size - *off)
+	    size = snap->info.size - *off;
+
+	while (done < size) {
+	    pos = *off + done;
+	    n = min_t(size_t, PAGE_SIZE - (pos & ~PAGE_MASK), size - done);
+	    if (copy_to_user(buf + done, page_address(
+	    		snap->pages[pos >> PAGE_SHIFT]) + (pos & ~PAGE_MASK), n)) {
+		ret = -EFAULT;
+		break;
+	    }
+	    done += n;
+	}
+
+	*off += done;
+
+out:
+	cdata_snap_put(snap);
+
+	return done ? done : ret;
 }
 
-static int cdata_ioctl(struct inode *inode, struct file *filp, 
-				unsigned int cmd, unsigned long arg)
+static long cdata_ioctl(struct file *filp, unsigned int cmd,
+				unsigned long arg)
 {
 	struct	cdata_t	*cdata = (struct cdata_t *)filp->private_data;
-	unsigned int	*fb = cdata->fb;
-	int 		n;
-	unsigned int 	*num = (unsigned int *)arg;
+	struct	cdata_fb *fb = cdata->dev;
+	struct	cdata_layer *l = &cdata->layer;
+	struct	cdata_rect rect;
+	struct	cdata_layer_info info;
+	struct	cdata_palette *pal;
+	struct	cdata_snapshot snapshot;
+	struct	cdata_submit sub;
+	struct	cdata_atlas atlas;
+	struct	cdata_text text;
+	struct	cdata_correction *corr;
+	unsigned int	n;
+	int		fmt;
+	int		ret;
+	u32		color;
 
 	switch (cmd) {
-	    case CDATA_CLEAR:
-			for (n = 0; n < num; n++) {
-			    writel(0x00000000, fb++);
+	    case CDATA_SET_FORMAT:
+			if (get_user(fmt, (int __user *)arg))
+			    return -EFAULT;
+			if (fmt < 0 || fmt >= ARRAY_SIZE(cdata_fmts))
+			    return -EINVAL;
+			cdata_fb_set_format(fb, &cdata_fmts[fmt]);
+			filp->f_pos = 0;
+			return 0;
+	    case CDATA_PAN:
+			if (get_user(n, (unsigned int __user *)arg))
+			    return -EFAULT;
+			return cdata_fb_pan(fb, n);
+	    case CDATA_SET_ROTATE:
+			if (get_user(n, (unsigned int __user *)arg))
+			    return -EFAULT;
+			return cdata_fb_set_rotate(fb, n);
+	    case CDATA_SET_PALETTE:
+			pal = kmalloc(sizeof(*pal), GFP_KERNEL);
+			if (!pal)
+			    return -ENOMEM;
+			ret = -EFAULT;
+			if (!copy_from_user(pal, (void __user *)arg,
+						sizeof(*pal)))
+			    ret = cdata_fb_set_palette(fb, pal);
+			kfree(pal);
+			return ret;
+	    case CDATA_SNAPSHOT:
+			ret = cdata_snapshot(cdata, &snapshot);
+			if (ret)
+			    return ret;
+			if (copy_to_user((void __user *)arg, &snapshot,
+						sizeof(snapshot)))
+			    return -EFAULT;
+			return 0;
+	    case CDATA_SUBMIT:
+			if (copy_from_user(&sub, (void __user *)arg,
+						sizeof(sub)))
+			    return -EFAULT;
+			return cdata_ring_submit(cdata, &sub);
+	    case CDATA_SET_ATLAS:
+			if (copy_from_user(&atlas, (void __user *)arg,
+						sizeof(atlas)))
+			    return -EFAULT;
+			return cdata_set_atlas(cdata, &atlas);
+	    case CDATA_TEXT:
+			if (copy_from_user(&text, (void __user *)arg,
+						sizeof(text)))
+			    return -EFAULT;
+			return cdata_text(cdata, &text);
+	    case CDATA_SET_CORRECTION:
+			corr = kmalloc(sizeof(*corr), GFP_KERNEL);
+			if (!corr)
+			    return -ENOMEM;
+			ret = -EFAULT;
+			if (!copy_from_user(corr, (void __user *)arg,
+						sizeof(*corr)))
+			    ret = cdata_fb_set_correction(fb, corr);
+			kfree(corr);
+			return ret;
+	    case CDATA_SET_LAYER:
+			if (copy_from_user(&info, (void __user *)arg,
+						sizeof(info)))
+			    return -EFAULT;
+			ret = cdata_layer_set(fb, l, &info);
+			if (ret == 0)
+			    filp->f_pos = 0;
+			return ret;
+	    case CDATA_FLUSH:
+			if (copy_from_user(&rect, (void __user *)arg,
+						sizeof(rect)))
+			    return -EFAULT;
+			down_read(&fb->mode_sem);
+			ret = -EINVAL;
+			if (rect.x < l->w && rect.y < l->h) {
+			    if (rect.w > l->w - rect.x)
+				rect.w = l->w - rect.x;
+			    if (rect.h > l->h - rect.y)
+				rect.h = l->h - rect.y;
+			    cdata_layer_damage(fb, l, rect.x, rect.y,
+			    		rect.x + rect.w, rect.y + rect.h);
+			    ret = 0;
 			}
-			cdata->fb_cur = num;
-			break;
+			up_read(&fb->mode_sem);
+			return ret;
+	    case CDATA_CLEAR:
+			if (get_user(n, (unsigned int __user *)arg))
+			    return -EFAULT;
+			down_read(&fb->mode_sem);
+			n *= fb->fmt->bpp;
+			if (n > l->w * l->h * fb->fmt->bpp)
+			    n = l->w * l->h * fb->fmt->bpp;
+			memset(l->buf, 0, n);
+			cdata_layer_damage_span(fb, l, 0, n);
+			up_read(&fb->mode_sem);
+			filp->f_pos = n;
+			return 0;
 	    case CDATA_RED:
-			for (n = 0; n < LCD_SIZE; n++) {
-			    writel(0x00ff0000, fb++);
-			}
-			cdata->fb_cur = LCD_SIZE;
+			color = 0x00ff0000;
 			break;
 	    case CDATA_GREEN:
-			for (n = 0; n < LCD_SIZE; n++) {
-			    writel(0x0000ff00, fb++);
-			}
-			cdata->fb_cur = LCD_SIZE;
+			color = 0x0000ff00;
 			break;
 	    case CDATA_BLUE:
-			for (n = 0; n < LCD_SIZE; n++) {
-			    writel(0x000000ff, fb++);
-			}
-			cdata->fb_cur = LCD_SIZE;
+			color = 0x000000ff;
 			break;
-
 	    case CDATA_BLACK:
-			for (n = 0; n < LCD_SIZE; n++) {
-			    writel(0x00ffffff, fb++);
-			}
-			cdata->fb_cur = LCD_SIZE;
+			color = 0x00000000;
 			break;
 	    case CDATA_WHITE:
-			for (n = 0; n < LCD_SIZE; n++) {
-			    writel(0x00000000, fb++);
-			}
-			cdata->fb_cur = LCD_SIZE;
+			color = 0x00ffffff;
 			break;
 	    default:
 			return -ENOTTY;
 	}
 
+	/* solid colours fill the caller's layer */
+	down_read(&fb->mode_sem);
+	cdata_layer_fill(fb, l, color);
+	filp->f_pos = 0;
+	up_read(&fb->mode_sem);
+
 	return 0;
 }
 
-static int cdata_mmap(struct file *filp, 
-			struct vm_area_struct *vma) 
+/*
+ * The snapshot pages go into the mapping itself, which keeps them
+ * after the file has moved on to a newer snapshot.
+ */
+static int cdata_snap_mmap(struct cdata_t *cdata, struct vm_area_struct *vma)
 {
-	unsigned long from;
-	unsigned long to;
-	unsigned long size;
+	struct	cdata_snap *snap;
+	unsigned long pgoff, addr;
+	unsigned int i;
+	int ret = 0;
 
-	from = vma->vm_start;
-	to = 0x33f00000;
-	size = vma->vm_end-vma->vm_start;
+	if (vma->vm_flags & VM_WRITE)
+	    return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
 
-	while (size) {
-	    remap_page_range(from, to, PAGE_SIZE, PAGE_SHARED);
+	snap = cdata_snap_get(cdata);
+	if (!snap)
+	    return -ENODATA;
 
-	    from += PAGE_SIZE;
-	    to += PAGE_SIZE;
-	    size -= PAGE_SIZE;
+	pgoff = vma->vm_pgoff - (CDATA_SNAPSHOT_OFFSET >> PAGE_SHIFT);
+	if (pgoff + vma_pages(vma) > snap->npages) {
+	    ret = -EINVAL;
+	    goto out;
 	}
 
-	printk(KERN_ALERT "vma start: %p\n", vma->vm_start);
-	printk(KERN_ALERT "vma end: %p\n", vma->vm_end);
+	for (i = 0, addr = vma->vm_start; addr < vma->vm_end;
+			i++, addr += PAGE_SIZE) {
+	    ret = vm_insert_page(vma, addr, snap->pages[pgoff + i]);
+	    if (ret)
+		break;
+	}
 
-	return 0;
+out:
+	cdata_snap_put(snap);
+	return ret;
+}
+
+/* count the layer's mappings, so a resize knows when buf is free */
+static void cdata_layer_vm_open(struct vm_area_struct *vma)
+{
+	struct cdata_layer *l = vma->vm_private_data;
+
+	atomic_inc(&l->mapped);
+}
+
+static void cdata_layer_vm_close(struct vm_area_struct *vma)
+{
+	struct cdata_layer *l = vma->vm_private_data;
+
+	atomic_dec(&l->mapped);
+}
+
+static struct vm_operations_struct cdata_layer_vm_ops = {
+	open:		cdata_layer_vm_open,
+	close:		cdata_layer_vm_close,
+};
+
+/* map the file's layer; clients report what they drew with CDATA_FLUSH */
+static int cdata_mmap(struct file *filp,
+			struct vm_area_struct *vma)
+{
+	struct	cdata_t	*cdata = (struct cdata_t *)filp->private_data;
+	struct	cdata_fb *fb = cdata->dev;
+	int ret;
+
+	if (vma->vm_pgoff >= (CDATA_SNAPSHOT_OFFSET >> PAGE_SHIFT))
+	    return cdata_snap_mmap(cdata, vma);
+	if (vma->vm_pgoff >= (CDATA_RING_OFFSET >> PAGE_SHIFT))
+	    return cdata_ring_mmap(cdata, vma);
+
+	down_read(&fb->mode_sem);
+	ret = remap_vmalloc_range(vma, cdata->layer.buf, vma->vm_pgoff);
+	if (ret == 0) {
+	    vma->vm_private_data = &cdata->layer;
+	    vma->vm_ops = &cdata_layer_vm_ops;
+	    /* ->open is only called for copies of this vma */
+	    atomic_inc(&cdata->layer.mapped);
+	}
+	up_read(&fb->mode_sem);
+
+	return ret;
 }
 
-static struct file_operations cdata_fops = {	
+static struct file_operations cdata_fops = {
 	owner:		THIS_MODULE,
 	open:		cdata_open,
+	llseek:		cdata_llseek,
+	read:		cdata_read,
 	write:		cdata_write,
-	ioctl:		cdata_ioctl,
+	unlocked_ioctl:	cdata_ioctl,
 	mmap:		cdata_mmap,
 	release:	cdata_close,
 };
 
 static struct miscdevice cdata_misc = {
-	minor:	CDATA_MINOR,
+	minor:	CDATA_FB_MINOR,
 	name:	"cdata",
 	fops:	&cdata_fops,
 };
 
-static int __init s3c2410fb_probe(struct platform_device *pdev)
+/*** statistics *****/
+
+static u64 per_sec(u64 n, u64 ns)
+{
+	ns = div64_u64(ns, NSEC_PER_MSEC);
+	return div64_u64(n * MSEC_PER_SEC, ns ? ns : 1);
+}
+
+static int cdata_stats_show(struct seq_file *m, void *v)
+{
+	struct cdata_fb *fb = (struct cdata_fb *)m->private;
+	struct cdata_fb_stats st;
+	u64 ns, frames;
+
+	spin_lock_irq(&fb->lock);
+	st = fb->stats;
+	spin_unlock_irq(&fb->lock);
+
+	ns = ktime_to_ns(ktime_sub(ktime_get(), st.since));
+	frames = st.frames ? st.frames : 1;
+
+	seq_printf(m, "frames:          %llu\n", st.frames);
+	seq_printf(m, "frames_per_sec:  %llu\n", per_sec(st.frames, ns));
+	seq_printf(m, "bytes_per_sec:   %llu\n", per_sec(st.bytes, ns));
+	seq_printf(m, "flush_avg_us:    %llu\n",
+			div64_u64(st.flush_ns, frames * NSEC_PER_USEC));
+	seq_printf(m, "flush_max_us:    %llu\n",
+			div64_u64(st.flush_max_ns, NSEC_PER_USEC));
+	seq_printf(m, "dirty_percent:   %llu\n",
+			div64_u64(st.pixels * 100, frames * LCD_SIZE));
+	seq_printf(m, "missed_vblanks:  %llu\n", st.missed);
+	seq_printf(m, "write_changed_percent: %llu\n",
+			div64_u64(st.changed * 100, st.written ? st.written : 1));
+
+	return 0;
+}
+
+static int cdata_stats_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, cdata_stats_show, inode->i_private);
+}
+
+/* any write starts the counters over */
+static ssize_t cdata_stats_write(struct file *filp, const char __user *buf,
+			size_t size, loff_t *off)
+{
+	struct seq_file *m = (struct seq_file *)filp->private_data;
+	struct cdata_fb *fb = (struct cdata_fb *)m->private;
+
+	spin_lock_irq(&fb->lock);
+	memset(&fb->stats, 0, sizeof(fb->stats));
+	fb->stats.since = ktime_get();
+	spin_unlock_irq(&fb->lock);
+
+	return size;
+}
+
+static struct file_operations cdata_stats_fops = {
+	owner:		THIS_MODULE,
+	open:		cdata_stats_open,
+	read:		seq_read,
+	write:		cdata_stats_write,
+	llseek:		seq_lseek,
+	release:	single_release,
+};
+
+/*** device *****/
+
+static struct cdata_fb *cdata_fb_alloc(unsigned char *panel, unsigned int rows)
+{
+	struct cdata_fb *fb;
+
+	fb = kzalloc(sizeof(struct cdata_fb), GFP_KERNEL);
+	if (!fb)
+	    return NULL;
+
+	/* room for the widest format, so format changes never reallocate */
+	fb->shadow = vmalloc(LCD_LINE*rows);
+	fb->line = kmalloc(LCD_LINE, GFP_KERNEL);
+	fb->tile = kmalloc(ROT_BAND*LCD_HEIGHT*sizeof(u32), GFP_KERNEL);
+	fb->rot = kmalloc(ROT_BAND*LCD_HEIGHT*sizeof(u32), GFP_KERNEL);
+	if (!fb->shadow || !fb->line || !fb->tile || !fb->rot)
+	    goto fail;
+
+	fb->fb = panel;
+	fb->rows = rows;
+	fb->xres = LCD_WIDTH;
+	fb->yres = LCD_HEIGHT;
+	fb->yres_virtual = rows;
+	fb->fmt = &cdata_fmts[CDATA_FMT_XRGB8888];
+	fb->pitch = LCD_LINE;
+	cdata_default_palette(fb->pal);
+
+	init_rwsem(&fb->mode_sem);
+	spin_lock_init(&fb->lock);
+	box_clear(&fb->dirty);
+	box_clear(&fb->comp);
+	box_clear(&fb->snap_dirty);
+	init_waitqueue_head(&fb->snap_wq);
+	INIT_LIST_HEAD(&fb->layers);
+	init_waitqueue_head(&fb->wq);
+	fb->stats.since = ktime_get();
+
+	return fb;
+
+fail:
+	kfree(fb->rot);
+	kfree(fb->tile);
+	kfree(fb->line);
+	vfree(fb->shadow);
+	kfree(fb);
+	return NULL;
+}
+
+static void cdata_fb_free(struct cdata_fb *fb)
+{
+	cdata_snap_put(fb->snap);
+	kfree(fb->ctab);
+	kfree(fb->rot);
+	kfree(fb->tile);
+	kfree(fb->line);
+	vfree(fb->shadow);
+	kfree(fb);
+}
+
+#ifdef CDATA_FB_BENCH
+/*
+ * Build with -DCDATA_FB_BENCH to measure the flush bandwidth when the
+ * module is loaded.  A vmalloc'd region stands in for the panel, so
+ * the numbers compare the copy loops rather than the LCD bus.
+ */
+#define	BENCH_LOOPS	(200)
+
+static const char *bench_names[] = { "xrgb8888", "rgb565", "rgb888", "c8" };
+
+static void cdata_bench_cvt(void)
 {
+	u32 *dst, *pal;
+	u8 *src;
+	ktime_t t0;
+	u64 ns;
+	int i, n;
+
+	src = vmalloc(LCD_LENGTH);
+	dst = vmalloc(LCD_LENGTH);
+	pal = kmalloc(256*sizeof(u32), GFP_KERNEL);
+	if (!src || !dst || !pal)
+	    goto out;
+
+	memset(src, 0xa5, LCD_LENGTH);
+	cdata_default_palette(pal);
+
+	for (i = 0; i < ARRAY_SIZE(cdata_fmts); i++) {
+	    t0 = ktime_get();
+	    for (n = 0; n < BENCH_LOOPS; n++)
+		cdata_fmts[i].cvt(dst, src, LCD_SIZE, pal);
+	    ns = ktime_to_ns(ktime_sub(ktime_get(), t0));
+	    printk(KERN_ALERT "cdata: %s convert: %llu ns, %llu Mpixel/s\n",
+		bench_names[i], ns,
+		div64_u64((u64)LCD_SIZE * BENCH_LOOPS * 1000, ns ? ns : 1));
+	}
+
+out:
+	kfree(pal);
+	vfree(dst);
+	vfree(src);
+}
+
+/* table expansion against a bit at a time, 8x16 glyphs into XRGB8888 */
+static void cdata_bench_glyph(void)
+{
+	u32 *dst;
+	ktime_t t0;
+	u64 ns;
+	int n, r;
+
+	dst = vmalloc(LCD_LENGTH);
+	if (!dst)
+	    return;
+
+	t0 = ktime_get();
+	for (n = 0; n < BENCH_LOOPS*100; n++)
+	    for (r = 0; r < 16; r++)
+		expand_row32(dst + r*LCD_WIDTH, 0xa5000000 >> (r & 3), 8,
+				0xffffff, 0, 1);
+	ns = ktime_to_ns(ktime_sub(ktime_get(), t0));
+	printk(KERN_ALERT "cdata: glyph expand, table: %llu ns\n", ns);
+
+	t0 = ktime_get();
+	for (n = 0; n < BENCH_LOOPS*100; n++)
+	    for (r = 0; r < 16; r++)
+		expand_row((u8 *)(dst + r*LCD_WIDTH), 4,
+				0xa5000000 >> (r & 3), 8, 0xffffff, 0, 1);
+	ns = ktime_to_ns(ktime_sub(ktime_get(), t0));
+	printk(KERN_ALERT "cdata: glyph expand, bitwise: %llu ns\n", ns);
+
+	vfree(dst);
+}
+
+static const char *corr_names[] = { "lut", "dither", "lut+dither" };
+
+static void cdata_fb_bench(void)
+{
+	struct cdata_correction *corr;
+	struct cdata_fb *fb;
+	unsigned char *panel;
+	ktime_t t0;
+	u64 ns;
+	int i, n;
+
+	panel = vmalloc(LCD_LENGTH);
+	if (!panel)
+	    return;
+
+	fb = cdata_fb_alloc(panel, LCD_HEIGHT*2);
+	if (!fb)
+	    goto out;
+
+	memset(fb->shadow, 0x5a, LCD_LINE*fb->yres_virtual);
+
+	/* the old per-byte copy of a full screen, for reference */
+	t0 = ktime_get();
+	for (n = 0; n < BENCH_LOOPS; n++)
+	    for (i = 0; i < LCD_LENGTH; i++)
+		writeb(fb->shadow[i], panel + i);
+	ns = ktime_to_ns(ktime_sub(ktime_get(), t0));
+	printk(KERN_ALERT "cdata: writeb flush: %llu ns, %llu MB/s\n",
+		ns, div64_u64((u64)LCD_LENGTH * BENCH_LOOPS * 1000, ns ? ns : 1));
+
+	/* full-screen flush, which is also what an emulated pan costs */
+	for (i = 0; i < ARRAY_SIZE(cdata_fmts); i++) {
+	    fb->fmt = &cdata_fmts[i];
+	    fb->pitch = fb->xres*fb->fmt->bpp;
+
+	    t0 = ktime_get();
+	    for (n = 0; n < BENCH_LOOPS; n++) {
+		fb->yoffset = n % LCD_HEIGHT;
+		fb->repaint = 1;
+		cdata_fb_flush(fb);
+	    }
+	    ns = ktime_to_ns(ktime_sub(ktime_get(), t0));
+	    printk(KERN_ALERT "cdata: %s flush: %llu ns, %llu MB/s\n",
+		bench_names[i], ns,
+		div64_u64((u64)LCD_LENGTH * BENCH_LOOPS * 1000, ns ? ns : 1));
+	}
+
+	/* the same full-screen XRGB8888 flush with calibration */
+	fb->fmt = &cdata_fmts[CDATA_FMT_XRGB8888];
+	fb->pitch = LCD_LINE;
+	corr = kzalloc(sizeof(*corr), GFP_KERNEL);
+	for (i = 0; corr && i < 3; i++) {
+	    for (n = 0; n < 256; n++)
+		corr->lut[0][n] = corr->lut[1][n] = corr->lut[2][n] = 255 - n;
+	    corr->flags = i + 1;
+	    corr->dither_bits = 6;
+	    cdata_fb_set_correction(fb, corr);
+	    memset(fb->shadow, 0x5a, LCD_LINE*fb->rows);
+
+	    t0 = ktime_get();
+	    for (n = 0; n < BENCH_LOOPS; n++) {
+		fb->repaint = 1;
+		cdata_fb_flush(fb);
+	    }
+	    ns = ktime_to_ns(ktime_sub(ktime_get(), t0));
+	    printk(KERN_ALERT "cdata: %s flush: %llu ns, %llu MB/s\n",
+		corr_names[i], ns,
+		div64_u64((u64)LCD_LENGTH * BENCH_LOOPS * 1000, ns ? ns : 1));
+	}
+	if (corr) {
+	    corr->flags = 0;
+	    cdata_fb_set_correction(fb, corr);
+	    kfree(corr);
+	}
+
+	/* the same full-screen XRGB8888 flush at every rotation */
+	for (i = 0; i < 360; i += 90) {
+	    cdata_fb_set_rotate(fb, i);
+	    memset(fb->shadow, 0x5a, LCD_LINE*fb->rows);
+
+	    t0 = ktime_get();
+	    for (n = 0; n < BENCH_LOOPS; n++) {
+		fb->repaint = 1;
+		cdata_fb_flush(fb);
+	    }
+	    ns = ktime_to_ns(ktime_sub(ktime_get(), t0));
+	    printk(KERN_ALERT "cdata: rotate %d flush: %llu ns, %llu MB/s\n",
+		i, ns,
+		div64_u64((u64)LCD_LENGTH * BENCH_LOOPS * 1000, ns ? ns : 1));
+	}
+
+	cdata_fb_free(fb);
+
+	cdata_bench_cvt();
+	cdata_bench_glyph();
+
+out:
+	vfree(panel);
+}
+#endif
+
+static int s3c2410fb_probe(struct platform_device *pdev)
+{
+    unsigned char *panel;
+    unsigned int rows;
+
+    rows = yres_virtual;
+    if (rows < LCD_HEIGHT)
+	rows = LCD_HEIGHT;
+    if (hwpan && rows > LCD_VMEM / LCD_LINE)
+	rows = LCD_VMEM / LCD_LINE;
+
+    /* draw LCD panel at 0x33F00000 */
+    panel = ioremap(LCD_PHYS, hwpan ? rows*LCD_LINE : LCD_LENGTH);
+    if (!panel)
+	return -ENOMEM;
+
+    cdata_fb = cdata_fb_alloc(panel, rows);
+    if (!cdata_fb)
+	goto fail_alloc;
+
+    if (hwpan) {
+	cdata_fb->regs = ioremap(S3C2410_LCD_BASE, PAGE_SIZE);
+	if (!cdata_fb->regs)
+	    goto fail_regs;
+	cdata_fb->pan = s3c2410_pan;
+	s3c2410_pan(cdata_fb, 0);
+    }
+
+    if (rotate && cdata_fb_set_rotate(cdata_fb, rotate))
+	printk(KERN_ALERT "cdata: rotate=%u ignored\n", rotate);
+
+    cdata_fb->compositor = kthread_run(cdata_compositor, cdata_fb,
+    					"cdata-fb");
+    if (IS_ERR(cdata_fb->compositor))
+	goto fail_thread;
+
     if (misc_register(&cdata_misc) < 0) {
 	printk(KERN_ALERT "cdata: register failed.\n");
-	return -1;
+	goto fail_misc;
     }
+
+    /* /sys/kernel/debug/cdata-fb/stats, optional */
+    cdata_fb->debugfs = debugfs_create_dir("cdata-fb", NULL);
+    if (!IS_ERR_OR_NULL(cdata_fb->debugfs))
+	debugfs_create_file("stats", 0644, cdata_fb->debugfs, cdata_fb,
+				&cdata_stats_fops);
+
+    return 0;
+
+fail_misc:
+    kthread_stop(cdata_fb->compositor);
+fail_thread:
+    if (cdata_fb->regs)
+	iounmap(cdata_fb->regs);
+fail_regs:
+    cdata_fb_free(cdata_fb);
+fail_alloc:
+    iounmap(panel);
+    return -1;
+}
+
+static int s3c2410fb_remove(struct platform_device *pdev)
+{
+    debugfs_remove_recursive(cdata_fb->debugfs);
+    misc_deregister(&cdata_misc);
+    kthread_stop(cdata_fb->compositor);
+
+    if (cdata_fb->regs)
+	iounmap(cdata_fb->regs);
+    iounmap(cdata_fb->fb);
+    cdata_fb_free(cdata_fb);
+
+    return 0;
 }
 
 static struct platform_driver s3c2410fb_driver = {
 	.probe		= s3c2410fb_probe,
 	.remove		= s3c2410fb_remove,
-	.suspend	= s3c2410fb_suspend,
-	.resume		= s3c2410fb_resume,
 	.driver		= {
 		.name	= "s3c2410-lcd",
 		.owner	= THIS_MODULE,
@@ -319,6 +2756,11 @@ static struct platform_driver s3c2410fb_driver = {
 
 int __init cdata_fb_init_module(void)
 {
+    cdata_fmt_init();
+
+#ifdef CDATA_FB_BENCH
+    cdata_fb_bench();
+#endif
     return platform_driver_register(&s3c2410fb_driver);
 
     printk(KERN_ALERT "cdata: hello day1\n");
@@ -327,7 +2769,7 @@ int __init cdata_fb_init_module(void)
 
 void __exit cdata_fb_cleanup_module(void)
 {
-    misc_deregister(&cdata_misc);
+    platform_driver_unregister(&s3c2410fb_driver);
 
     printk(KERN_ALERT "cdata: bye\n");
 }
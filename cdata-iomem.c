@@ -12,6 +12,13 @@
 #include <linux/irq.h>
 #include <linux/miscdevice.h>
 #include <linux/input.h>
+#include <linux/workqueue.h>
+#include <linux/cpumask.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/tick.h>
 #include <asm/io.h>
 #include <asm/uaccess.h>
 
@@ -23,6 +30,41 @@
 #define VGA_MODE_BPP        32
 #define BUF_SIZE            1024
 
+/*
+ * Where the flush work runs.  CDATA_CPU_WRITER keeps the buffer in the
+ * writer's cache, CDATA_CPU_FIXED pins it to one CPU, CDATA_CPU_UNBOUND
+ * leaves it to the scheduler and CDATA_CPU_LEAST_LOADED picks the CPU
+ * of the mask that was least busy lately, with the fewest cdata
+ * flushes outstanding among equals.  An offline fixed CPU, or a mask
+ * with no CPU online, falls back to unbound.
+ */
+static int placement = CDATA_CPU_UNBOUND;
+module_param(placement, int, 0644);
+MODULE_PARM_DESC(placement, "default flush placement: 0 writer, 1 fixed, 2 unbound, 3 least loaded");
+
+static int flush_cpu;
+module_param(flush_cpu, int, 0644);
+MODULE_PARM_DESC(flush_cpu, "CPU for the fixed placement");
+
+static struct workqueue_struct *cdata_unbound_wq;
+static atomic_t cdata_pending[NR_CPUS];
+
+/*
+ * How busy each CPU has been, from the kernel's NO_HZ idle accounting.
+ * A CPU is sampled again once LOAD_PERIOD_US has passed since its last
+ * sample, so busy covers the last period or so before a pick.
+ */
+#define LOAD_PERIOD_US      10000
+
+struct cdata_cpu_load {
+    u64                 idle;           /* us, at the last sample */
+    u64                 wall;
+    unsigned int        busy;           /* per mille of that period */
+};
+
+static DEFINE_PER_CPU(struct cdata_cpu_load, cdata_load);
+static DEFINE_SPINLOCK(cdata_load_lock);
+
 struct cdata_t {
     char *buf;
     unsigned int        index;
@@ -31,49 +73,146 @@ struct cdata_t {
     unsigned char        *fbmem_start, *fbmem_end;
 
     //struct semaphore sem;
-    struct mutex *lock;
+    struct mutex lock;
 
     struct work_struct work;
+
+    struct cdata_placement place;
+    int                 queued_cpu;     /* -1 when unbound */
+    u64                 flush_ns;       /* last flush, for the benchmark */
 };
 
 // Global lock
 DEFINE_MUTEX(cdata_sem);
 
-void flush_buffer((struct work_struct *work)
+static void flush_buffer(struct work_struct *work)
 {
     struct cdata_t *cdata = container_of(work, struct cdata_t, work);
     unsigned char *ioaddr;
+    ktime_t t0;
     int i;
     char d;
 
+    t0 = ktime_get();
+
     ioaddr = (unsigned char *)cdata->fbmem;
 
     for (i = 0; i < BUF_SIZE; i++) {
         if (ioaddr >= cdata->fbmem_end)
             ioaddr = cdata->fbmem_start;
 
-        d = atomic_read(&cdata->buf[i]);
-        writeb(d, ioaddr++); 
+        d = cdata->buf[i];
+        writeb(d, ioaddr++);
     }
 
     cdata->fbmem = ioaddr;
+    cdata->flush_ns = ktime_to_ns(ktime_sub(ktime_get(), t0));
 
-    //mutex_lock(&cdata->lock);
-    spin_lock_irq();
+    if (cdata->queued_cpu >= 0)
+        atomic_dec(&cdata_pending[cdata->queued_cpu]);
+
+    // NOTE: runs from a workqueue, so it may sleep on the per-open lock
+    mutex_lock(&cdata->lock);
     cdata->index = 0;
-    spin_unlock_irq();
-    //mutex_unlock(&cdata->lock);
+    mutex_unlock(&cdata->lock);
 
     wake_up(&cdata->wq);
 }
 
+/* 0 to 1000; always 0 without NO_HZ, then only the flushes count */
+static unsigned int cdata_cpu_busy(int cpu)
+{
+    struct cdata_cpu_load *load = &per_cpu(cdata_load, cpu);
+    unsigned long flags;
+    unsigned int busy;
+    u64 idle, wall, di, dw;
+
+    idle = get_cpu_idle_time_us(cpu, &wall);
+    if (idle == -1ULL)
+        return 0;
+
+    spin_lock_irqsave(&cdata_load_lock, flags);
+    dw = wall - load->wall;
+    if (dw >= LOAD_PERIOD_US) {
+        di = idle - load->idle;
+        load->busy = di >= dw ? 0 : div64_u64((dw - di) * 1000, dw);
+        load->idle = idle;
+        load->wall = wall;
+    }
+    busy = load->busy;
+    spin_unlock_irqrestore(&cdata_load_lock, flags);
+
+    return busy;
+}
+
+static int cdata_pick_cpu(struct cdata_placement *place)
+{
+    unsigned int busy, min_busy;
+    int cpu, best, n, min;
+
+    switch (place->policy) {
+        case CDATA_CPU_WRITER:
+            return raw_smp_processor_id();
+        case CDATA_CPU_FIXED:
+            if (place->cpu >= 0 && place->cpu < nr_cpu_ids &&
+                cpu_online(place->cpu))
+                return place->cpu;
+            return -1;
+        case CDATA_CPU_LEAST_LOADED:
+            best = -1;
+            min = INT_MAX;
+            min_busy = UINT_MAX;
+            for_each_online_cpu(cpu) {
+                if (cpu >= BITS_PER_LONG || !(place->mask & (1UL << cpu)))
+                    continue;
+                busy = cdata_cpu_busy(cpu);
+                n = atomic_read(&cdata_pending[cpu]);
+                if (busy < min_busy || (busy == min_busy && n < min)) {
+                    min_busy = busy;
+                    min = n;
+                    best = cpu;
+                }
+            }
+            return best;
+        default:
+            return -1;
+    }
+}
+
+/*
+ * Queue the flush according to the instance's placement.  The writer
+ * waits for the flush to drain the buffer, so the work is never still
+ * pending here.
+ */
+static void cdata_queue_flush(struct cdata_t *cdata)
+{
+    int cpu = cdata_pick_cpu(&cdata->place);
+
+    cdata->queued_cpu = cpu;
+
+    if (cpu < 0) {
+        queue_work(cdata_unbound_wq, &cdata->work);
+        return;
+    }
+
+    atomic_inc(&cdata_pending[cpu]);
+    schedule_work_on(cpu, &cdata->work);
+}
+
 static int cdata_open(struct inode *inode, struct file *filp)
 {
     struct cdata_t *cdata;
-    int i;
 
     cdata = (struct cdata_t *)kmalloc(sizeof(struct cdata_t), GFP_KERNEL);
-    cdata->buf = (char *)kmalloc(BUF_SIZE, GFP_KERNEL);
+    if (!cdata)
+        return -ENOMEM;
+
+    // NOTE: one more for the terminator cdata_close() and CDATA_SYNC add
+    cdata->buf = (char *)kmalloc(BUF_SIZE + 1, GFP_KERNEL);
+    if (!cdata->buf) {
+        kfree(cdata);
+        return -ENOMEM;
+    }
 
     cdata->index = 0;
     init_waitqueue_head(&cdata->wq);
@@ -83,11 +222,21 @@ static int cdata_open(struct inode *inode, struct file *filp)
 
     INIT_WORK(&cdata->work, flush_buffer);
 
-    cdata->fbmem_start = (unsigned int *) 
+    cdata->place.policy = placement;
+    cdata->place.cpu = flush_cpu;
+    cdata->place.mask = ~0UL;
+    cdata->queued_cpu = -1;
+
+    cdata->fbmem_start = (unsigned char *)
             ioremap(IO_MEM, VGA_MODE_WIDTH
                     * VGA_MODE_HEIGHT
                     * VGA_MODE_BPP
                     / 8);
+    if (!cdata->fbmem_start) {
+        kfree(cdata->buf);
+        kfree(cdata);
+        return -ENOMEM;
+    }
 
     cdata->fbmem_end = cdata->fbmem_start + VGA_MODE_WIDTH 
                                       * VGA_MODE_HEIGHT
@@ -98,12 +247,12 @@ static int cdata_open(struct inode *inode, struct file *filp)
 
     filp->private_data = (void *)cdata;
 
-    printk(KERN_INFO "in cdata_open: filp = %08x\n", filp);
+    printk(KERN_INFO "in cdata_open: filp = %p\n", filp);
 
     return 0;
 }
 
-static ssize_t cdata_read(struct file *filp, char *buf, size_t size, loff_t *off)
+static ssize_t cdata_read(struct file *filp, char __user *buf, size_t size, loff_t *off)
 {
     return 0;
 }
@@ -116,11 +265,11 @@ static ssize_t cdata_read(struct file *filp, char *buf, size_t size, loff_t *off
  *   - SMP support (avoid IO reordering, use memroy barrier)
  *   - code review
  */
-static ssize_t cdata_write(struct file *filp, const char *buf, size_t size, loff_t *off)
+static ssize_t cdata_write(struct file *filp, const char __user *buf, size_t size, loff_t *off)
 {
     struct cdata_t *cdata = (struct cdata_t *)filp->private_data;
     unsigned int index;
-    wait_queue_t wait;
+    DECLARE_WAITQUEUE(wait, current);
     int i;
 
     // NOTE: put shared data into local variables
@@ -139,28 +288,39 @@ static ssize_t cdata_write(struct file *filp, const char *buf, size_t size, loff
         if (index >= BUF_SIZE) {
             printk(KERN_INFO "cdata: buffer full\n");
 
-            schedule_work_on(1, &cdata->work);
+            // NOTE: the flush resets cdata->index, which we must publish first
+            mutex_lock(&cdata->lock);
+            cdata->index = index;
+            mutex_unlock(&cdata->lock);
 
-            wait.flags = 0;
-            wait.task = current;
+            cdata_queue_flush(cdata);
 
             // NOTE: must be atomic operation
             add_wait_queue(&cdata->wq, &wait);
 repeat:
             //current->state = TASK_INTERRUPTIBLE;
             set_current_state(TASK_INTERRUPTIBLE);
-            schedule()
 
             mutex_lock(&cdata->lock);
             index = cdata->index;
             mutex_unlock(&cdata->lock);
 
-            if (index != 0)
+            if (index != 0) {
+                // NOTE: the flush still runs and resets the index
+                if (signal_pending(current)) {
+                    set_current_state(TASK_RUNNING);
+                    remove_wait_queue(&cdata->wq, &wait);
+                    return i ? i : -ERESTARTSYS;
+                }
+                schedule();
                 goto repeat;
+            }
 
-            remove_wait_queue(wq, &wait);
+            set_current_state(TASK_RUNNING);
+            remove_wait_queue(&cdata->wq, &wait);
         }
-        copy_from_user(&cdata->buf[index], &buf[i], 1);
+        if (copy_from_user(&cdata->buf[index], &buf[i], 1))
+            break;
         index++;
     }
 
@@ -168,7 +328,7 @@ repeat:
     cdata->index = index;
     mutex_unlock(&cdata->lock);
 
-    return 0;
+    return i ? i : -EFAULT;
 }
 
 static int cdata_close(struct inode *inode, struct file *filp)
@@ -180,14 +340,49 @@ static int cdata_close(struct inode *inode, struct file *filp)
 
     printk(KERN_INFO "in cdata_close: %s\n", cdata->buf);
 
+    flush_work(&cdata->work);
+    iounmap(cdata->fbmem_start);
+    kfree(cdata->buf);
+    kfree(cdata);
+
     return 0;
 }
 
-int cdata_ioctl(struct inode *inode, struct file *filp, 
-                    unsigned int cmd, unsigned long arg)
+/*
+ * A CPU that goes offline later still falls back to unbound in
+ * cdata_pick_cpu(); what is wrong now is refused here.
+ */
+static int cdata_check_placement(const struct cdata_placement *place)
+{
+    int cpu;
+
+    switch (place->policy) {
+        case CDATA_CPU_WRITER:
+        case CDATA_CPU_UNBOUND:
+            return 0;
+        case CDATA_CPU_FIXED:
+            if (place->cpu < 0 || place->cpu >= nr_cpu_ids ||
+                !cpu_online(place->cpu))
+                return -EINVAL;
+            return 0;
+        case CDATA_CPU_LEAST_LOADED:
+            for_each_online_cpu(cpu) {
+                if (cpu < BITS_PER_LONG && (place->mask & (1UL << cpu)))
+                    return 0;
+            }
+            return -EINVAL;
+        default:
+            return -EINVAL;
+    }
+}
+
+static long cdata_ioctl(struct file *filp, unsigned int cmd,
+                    unsigned long arg)
 {
     struct cdata_t *cdata = (struct cdata_t *)filp->private_data;
     unsigned int index = cdata->index;
+    struct cdata_placement place;
+    int ret;
 
     switch (cmd) {
         case CDATA_EMPTY:
@@ -198,10 +393,23 @@ int cdata_ioctl(struct inode *inode, struct file *filp,
             printk(KERN_INFO "str: %s\n", cdata->buf);
             break;
         case CDATA_WRITE:
-            cdata->buf[index++] = *((char *)arg);
+            if (index >= BUF_SIZE)
+                return -ENOSPC;
+            if (get_user(cdata->buf[index], (char __user *)arg))
+                return -EFAULT;
+            index++;
+            break;
+        case CDATA_SET_PLACEMENT:
+            if (copy_from_user(&place, (void __user *)arg,
+                               sizeof(struct cdata_placement)))
+                return -EFAULT;
+            ret = cdata_check_placement(&place);
+            if (ret)
+                return ret;
+            cdata->place = place;
             break;
         default:
-            return -1;
+            return -ENOTTY;
     }
 
     cdata->index = index;
@@ -215,27 +423,122 @@ static struct file_operations __cdata_fops = {
         release:    cdata_close,
         read:       cdata_read,
         write:      cdata_write,
-        ioctl:      cdata_ioctl,
+        unlocked_ioctl: cdata_ioctl,
 };
 
 static struct miscdevice cdata_fops = {
         minor:      12,
-        name:       "cdata",
+        name:       "cdata-iomem",
         fops:       &__cdata_fops,
 };
 
-int cdata_init_module(void)
+#ifdef CDATA_IOMEM_BENCH
+/*
+ * Build with -DCDATA_IOMEM_BENCH to time a flush queued on the CPU that
+ * just filled the buffer against one queued on another online CPU.
+ * The flush target is plain memory so the difference is the cache
+ * migration of the buffer, not the bus.
+ */
+#define BENCH_LOOPS         100
+
+static u64 cdata_bench_flush(struct cdata_t *cdata, int cpu)
+{
+    u64 total = 0;
+    int i;
+
+    for (i = 0; i < BENCH_LOOPS; i++) {
+        memset(cdata->buf, i, BUF_SIZE);    /* on the writer CPU */
+
+        cdata->place.policy = CDATA_CPU_FIXED;
+        cdata->place.cpu = cpu;
+        cdata_queue_flush(cdata);
+        flush_work(&cdata->work);
+
+        total += cdata->flush_ns;
+    }
+
+    return div_u64(total, BENCH_LOOPS);
+}
+
+static void cdata_iomem_bench(void)
+{
+    struct cdata_t *cdata;
+    unsigned char *mem;
+    cpumask_var_t saved;
+    int writer, remote, cpu;
+
+    if (!alloc_cpumask_var(&saved, GFP_KERNEL))
+        return;
+
+    cdata = kzalloc(sizeof(struct cdata_t), GFP_KERNEL);
+    mem = kmalloc(BUF_SIZE, GFP_KERNEL);
+    if (!cdata || !mem)
+        goto out;
+    cdata->buf = kmalloc(BUF_SIZE, GFP_KERNEL);
+    if (!cdata->buf)
+        goto out;
+
+    init_waitqueue_head(&cdata->wq);
+    mutex_init(&cdata->lock);
+    INIT_WORK(&cdata->work, flush_buffer);
+    cdata->fbmem = cdata->fbmem_start = mem;
+    cdata->fbmem_end = mem + BUF_SIZE;
+
+    // NOTE: put insmod back where it was allowed to run afterwards
+    cpumask_copy(saved, tsk_cpus_allowed(current));
+
+    writer = get_cpu();
+    put_cpu();
+    set_cpus_allowed_ptr(current, cpumask_of(writer));
+
+    remote = -1;
+    for_each_online_cpu(cpu) {
+        if (cpu != writer) {
+            remote = cpu;
+            break;
+        }
+    }
+
+    printk(KERN_ALERT "cdata-iomem: flush on writer cpu%d: %llu ns\n",
+            writer, cdata_bench_flush(cdata, writer));
+    if (remote >= 0)
+        printk(KERN_ALERT "cdata-iomem: flush on remote cpu%d: %llu ns\n",
+                remote, cdata_bench_flush(cdata, remote));
+
+    set_cpus_allowed_ptr(current, saved);
+
+    kfree(cdata->buf);
+out:
+    kfree(mem);
+    kfree(cdata);
+    free_cpumask_var(saved);
+}
+#endif
+
+static int __init cdata_init_module(void)
 {
+    cdata_unbound_wq = alloc_workqueue("cdata-iomem", WQ_UNBOUND, 0);
+    if (!cdata_unbound_wq)
+        return -ENOMEM;
+
+#ifdef CDATA_IOMEM_BENCH
+    cdata_iomem_bench();
+#endif
+
     if (misc_register(&cdata_fops)) {
         printk(KERN_ALERT "cdata: register failed.\n");
+        destroy_workqueue(cdata_unbound_wq);
         return -1;
     }
-    printk(KERN_ALERT "cdata-fb: registered .\n");
+    printk(KERN_ALERT "cdata-iomem: registered .\n");
+
+    return 0;
 }
 
-void cdata_cleanup_module(void)
+static void __exit cdata_cleanup_module(void)
 {
     misc_deregister(&cdata_fops);
+    destroy_workqueue(cdata_unbound_wq);
 }
 
 module_init(cdata_init_module);
@@ -10,12 +10,446 @@
 #include <linux/mm.h>
 #include <linux/interrupt.h>
 #include <linux/irq.h>
+#include <linux/hrtimer.h>
 #include <linux/miscdevice.h>
+#include <linux/platform_device.h>
 #include <linux/input.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/ctype.h>
+#include <linux/math64.h>
 #include <asm/io.h>
 #include <asm/uaccess.h>
 
 
+/*
+ * While the pen is held an hrtimer ticks at rate Hz.  Each tick
+ * reports what the previous burst sampled as one event frame and
+ * starts the next burst of samples conversions, chained from the ADC
+ * interrupt.  The sample rate is the timer's, not the ADC's.
+ */
+#define	TS_RATE_MAX	1000
+
+static int rate = 100;
+module_param(rate, int, 0644);
+MODULE_PARM_DESC(rate, "frames per second while the pen is down");
+
+static int samples = 4;
+module_param(samples, int, 0644);
+MODULE_PARM_DESC(samples, "ADC conversions per frame, 1-16");
+
+/*
+ * Raw samples go through a fixed-point filter as each frame is built and
+ * only moves that still matter afterwards reach the input core:
+ *
+ *   median	median of the last median samples per axis (1-7)
+ *   max_var	drop a sample while the window strays from a straight
+ *		line by more than this, as a variance in ADC counts
+ *		squared (0 turns it off)
+ *   iir	smoothing weight of a new sample, 1-256 (256 = none)
+ *   jitter	report only moves of more than this many ADC counts
+ */
+#define	TS_MEDIAN_MAX	7
+#define	TS_RAW		16
+
+static int median = 5;
+module_param(median, int, 0644);
+MODULE_PARM_DESC(median, "median filter window, 1-7 samples");
+
+static int max_var = 400;
+module_param(max_var, int, 0644);
+MODULE_PARM_DESC(max_var, "reject samples while the window variance exceeds this");
+
+static int iir = 128;
+module_param(iir, int, 0644);
+MODULE_PARM_DESC(iir, "IIR weight of a new sample, out of 256");
+
+static int jitter = 3;
+module_param(jitter, int, 0644);
+MODULE_PARM_DESC(jitter, "smallest move reported, in ADC counts");
+
+struct ts_sample {
+	int x;
+	int y;
+	ktime_t t;		/* when the ADC delivered it */
+};
+
+struct ts_filter {
+	struct ts_sample win[TS_MEDIAN_MAX];
+	int size;		/* median the window was filled for */
+	int n;			/* samples in the window */
+	int pos;		/* next slot */
+	int sx, sy;		/* IIR state, Q8 */
+	int rx, ry;		/* last reported */
+	int primed;		/* sx, sy valid */
+	int reported;		/* rx, ry valid */
+};
+
+struct cdata_ts;
+
+/*
+ * What the pipeline needs from the ADC.  A backend calls
+ * cdata_ts_handler() from thread context on each pen edge it was
+ * armed for, and s3c2410_isr_adc() from interrupt context when a
+ * conversion started by start() is done.  wait_down(), wait_up() and
+ * start() are called with cdata->lock held.
+ */
+struct cdata_ts_ops {
+	const char *name;
+	int (*attach)(struct cdata_ts *cdata);
+	/* stop pen edges, cancel cdata->timer, then stop conversions */
+	void (*detach)(struct cdata_ts *cdata);
+	void (*wait_down)(struct cdata_ts *cdata);
+	void (*wait_up)(struct cdata_ts *cdata);
+	void (*start)(struct cdata_ts *cdata, int axis);
+	int (*read)(struct cdata_ts *cdata, int axis);
+};
+
+struct cdata_ts {
+	struct input_dev *input;
+	int x;
+	int y;
+	spinlock_t lock;
+	const struct cdata_ts_ops *ops;
+
+	/* from the ADC interrupt to the frame, under lock */
+	struct ts_sample raw[TS_RAW];
+	unsigned int head, tail;
+
+	/* ADC sequencing, under lock */
+	int down;		/* pen held, timer running */
+	int adc_busy;		/* a burst is converting */
+	int adc_state;		/* 0: first axis, 1: second */
+	int adc_left;		/* conversions left in the burst */
+	int adc_y;
+
+	struct hrtimer timer;
+	ktime_t period;
+
+	struct ts_filter filter;	/* frame only */
+
+	/* ADC interrupt to input_sync(), ns, under lock */
+	u64 lat_sum;
+	u32 lat_n;
+	u32 lat_max;
+};
+
+/* Called with lock held */
+static void cdata_ts_push(struct cdata_ts *cdata, int x, int y)
+{
+	/* a full ring drops the newest sample, the filter copes */
+	if (cdata->head - cdata->tail < TS_RAW) {
+	    cdata->raw[cdata->head % TS_RAW].x = x;
+	    cdata->raw[cdata->head % TS_RAW].y = y;
+	    cdata->raw[cdata->head % TS_RAW].t = ktime_get();
+	    cdata->head++;
+	}
+}
+
+/* Called with lock held */
+static void cdata_ts_start(struct cdata_ts *cdata)
+{
+	cdata->adc_busy = 1;
+	cdata->adc_state = 0;
+	cdata->ops->start(cdata, 0);
+}
+
+static inline void s3c2410_get_XY(struct cdata_ts *cdata)
+{
+	spin_lock(&cdata->lock);
+	if (!cdata->adc_busy)
+	    goto out;
+
+	if (cdata->adc_state == 0) { 
+		cdata->adc_state = 1;
+		cdata->adc_y = cdata->ops->read(cdata, 0);
+		cdata->ops->start(cdata, 1);
+	} else { 
+		cdata_ts_push(cdata, cdata->ops->read(cdata, 1), cdata->adc_y);
+
+		if (cdata->down && --cdata->adc_left > 0) {
+		    cdata_ts_start(cdata);
+		    goto out;
+		}
+
+		/* burst done; let the pen's next edge interrupt */
+		cdata->adc_busy = 0;
+		if (cdata->down)
+		    cdata->ops->wait_up(cdata);
+		else
+		    cdata->ops->wait_down(cdata);
+	}
+out:
+	spin_unlock(&cdata->lock);
+}
+
+/************************ filter ******************************/
+
+static void ts_filter_reset(struct ts_filter *f)
+{
+	memset(f, 0, sizeof(struct ts_filter));
+}
+
+/* median of n values, n <= TS_MEDIAN_MAX, by insertion sort of a copy */
+static int ts_median(const int *v, int n)
+{
+	int s[TS_MEDIAN_MAX];
+	int i, j, t;
+
+	for (i = 0; i < n; i++) {
+	    t = v[i];
+	    for (j = i; j > 0 && s[j-1] > t; j--)
+		s[j] = s[j-1];
+	    s[j] = t;
+	}
+
+	return s[n/2];
+}
+
+/*
+ * Sum of squared distances of v[0..n-1], oldest first, from their
+ * least-squares line.  A steady drag sits on the line whatever its
+ * speed; a pen landing or lifting does not.
+ */
+static int ts_spread(const int *v, int n)
+{
+	s64 st = 0, sv = 0, stt = 0, stv = 0, svv = 0;
+	s64 cvv, ctv, ctt;
+	int i;
+
+	if (n < 3)
+	    return 0;
+
+	for (i = 0; i < n; i++) {
+	    st += i;
+	    sv += v[i];
+	    stt += i*i;
+	    stv += i*v[i];
+	    svv += v[i]*v[i];
+	}
+
+	/* n times the centred sums */
+	cvv = n*svv - sv*sv;
+	ctv = n*stv - st*sv;
+	ctt = n*stt - st*st;
+
+	return div_s64(cvv - div_s64(ctv*ctv, ctt), n);
+}
+
+/*
+ * Run one raw sample through the pipeline.  Returns 1 with the point
+ * to report in *ox, *oy, or 0 if the sample was absorbed.
+ */
+static int ts_filter_push(struct ts_filter *f, int x, int y, int *ox, int *oy)
+{
+	int wx[TS_MEDIAN_MAX], wy[TS_MEDIAN_MAX];
+	int n, i, mx, my, a;
+
+	n = clamp(median, 1, TS_MEDIAN_MAX);
+
+	/* median changed under us: start the window over */
+	if (n != f->size) {
+	    f->size = n;
+	    f->n = 0;
+	    f->pos = 0;
+	}
+
+	f->win[f->pos].x = x;
+	f->win[f->pos].y = y;
+	f->pos = (f->pos + 1) % n;
+	if (f->n < n)
+	    f->n++;
+
+	/* oldest first, for the line fit */
+	for (i = 0; i < f->n; i++) {
+	    wx[i] = f->win[(f->pos - f->n + i + n) % n].x;
+	    wy[i] = f->win[(f->pos - f->n + i + n) % n].y;
+	}
+
+	/* a pen landing or lifting bends the window; wait it out */
+	if (max_var > 0 && f->n > 1 &&
+	    (ts_spread(wx, f->n) > max_var * f->n ||
+	     ts_spread(wy, f->n) > max_var * f->n))
+	    return 0;
+
+	mx = ts_median(wx, f->n);
+	my = ts_median(wy, f->n);
+
+	a = clamp(iir, 1, 256);
+	if (!f->primed) {
+	    f->sx = mx << 8;
+	    f->sy = my << 8;
+	    f->primed = 1;
+	} else {
+	    f->sx += ((mx << 8) - f->sx) * a >> 8;
+	    f->sy += ((my << 8) - f->sy) * a >> 8;
+	}
+
+	mx = (f->sx + 128) >> 8;
+	my = (f->sy + 128) >> 8;
+
+	if (f->reported && abs(mx - f->rx) <= jitter &&
+	    abs(my - f->ry) <= jitter)
+	    return 0;
+
+	f->rx = *ox = mx;
+	f->ry = *oy = my;
+	f->reported = 1;
+
+	return 1;
+}
+
+/******************************************************/
+
+/* sampling follows the misc device, not the input handle */
+static int ts_input_open(struct input_dev *dev)
+{	
+	return 0;
+}
+
+static void ts_input_close(struct input_dev *dev)
+{
+}
+
+/*
+ * Drain the raw samples through the filter.  Whatever survives is
+ * reported as one event frame, so a burst of samples costs userspace
+ * at most one wakeup.  Runs from the timer, or from the irq thread
+ * once the timer is cancelled, never both at once.
+ */
+static void cdata_ts_frame(struct cdata_ts *cdata, int up)
+{
+	struct input_dev *dev = cdata->input;
+	struct ts_sample s;
+	unsigned long flags;
+	ktime_t first = ktime_set(0, 0);
+	u32 ns;
+	int x, y, n = 0, report = 0;
+
+	for (;;) {
+	    spin_lock_irqsave(&cdata->lock, flags);
+	    if (cdata->tail == cdata->head) {
+		spin_unlock_irqrestore(&cdata->lock, flags);
+		break;
+	    }
+	    s = cdata->raw[cdata->tail % TS_RAW];
+	    cdata->tail++;
+	    spin_unlock_irqrestore(&cdata->lock, flags);
+
+	    if (n++ == 0)
+		first = s.t;
+
+	    if (ts_filter_push(&cdata->filter, s.x, s.y, &x, &y)) {
+		cdata->x = x;
+		cdata->y = y;
+		report = 1;
+	    }
+	}
+
+	if (report) {
+	    input_report_abs(dev, ABS_X, cdata->x);
+	    input_report_abs(dev, ABS_Y, cdata->y);
+	    input_report_key(dev, BTN_TOUCH, 1);
+	}
+
+	if (up) {
+	    if (cdata->filter.reported) {
+		input_report_key(dev, BTN_TOUCH, 0);
+		report = 1;
+	    }
+	    ts_filter_reset(&cdata->filter);
+	}
+
+	if (!report)
+	    return;
+
+	input_sync(dev);
+
+	/*
+	 * The rest of the way, input_sync() to read(), is the reader's
+	 * to measure against the event's own timestamp.
+	 */
+	if (n) {
+	    ns = ktime_to_ns(ktime_sub(ktime_get(), first));
+	    spin_lock_irqsave(&cdata->lock, flags);
+	    cdata->lat_sum += ns;
+	    cdata->lat_n++;
+	    if (ns > cdata->lat_max)
+		cdata->lat_max = ns;
+	    spin_unlock_irqrestore(&cdata->lock, flags);
+	}
+}
+
+static enum hrtimer_restart cdata_ts_tick(struct hrtimer *timer)
+{
+	struct cdata_ts *cdata = container_of(timer, struct cdata_ts, timer);
+
+	cdata_ts_frame(cdata, 0);
+
+	spin_lock(&cdata->lock);
+	/* a burst still converting just runs into the next frame */
+	if (!cdata->adc_busy) {
+	    cdata->adc_left = clamp(samples, 1, TS_RAW);
+	    cdata_ts_start(cdata);
+	}
+	spin_unlock(&cdata->lock);
+
+	hrtimer_forward_now(timer, cdata->period);
+
+	return HRTIMER_RESTART;
+}
+
+/*
+ * Pen edges.  The hard half is the default one; everything here may
+ * sleep, which hrtimer_cancel() needs.
+ */
+static irqreturn_t cdata_ts_handler(int irq, void *priv)
+{
+	struct cdata_ts *cdata = (struct cdata_ts *)priv;
+
+	if (!cdata->down) { /* NOW is down */
+	    cdata->period = ktime_set(0,
+			NSEC_PER_SEC / clamp(rate, 1, TS_RATE_MAX));
+
+	    spin_lock_irq(&cdata->lock);
+	    /* leftovers of the last touch's final burst */
+	    cdata->tail = cdata->head;
+	    cdata->down = 1;
+	    cdata->adc_left = clamp(samples, 1, TS_RAW);
+	    cdata_ts_start(cdata);
+	    spin_unlock_irq(&cdata->lock);
+
+	    hrtimer_start(&cdata->timer, cdata->period, HRTIMER_MODE_REL);
+	} else { /* NOW is up */
+	    hrtimer_cancel(&cdata->timer);
+
+	    spin_lock_irq(&cdata->lock);
+	    cdata->down = 0;
+	    /* an in-flight burst re-arms pen-down when it ends */
+	    if (!cdata->adc_busy)
+		cdata->ops->wait_down(cdata);
+	    spin_unlock_irq(&cdata->lock);
+
+	    cdata_ts_frame(cdata, 1);
+	}
+
+	return IRQ_HANDLED;
+}
+
+static irqreturn_t s3c2410_isr_adc(int irq, void *priv) 
+{
+	struct cdata_ts *cdata = (struct cdata_ts *)priv;
+
+	s3c2410_get_XY(cdata);
+
+	return IRQ_HANDLED;
+}
+
+/************************ S3C2410 ADC ******************************/
+
+#ifdef CONFIG_ARCH_S3C2410
+
 #define wait_down_int()	{ ADCTSC = DOWN_INT | XP_PULL_UP_EN | \
 				XP_AIN | XM_HIZ | YP_AIN | YM_GND | \
 				XP_PST(WAIT_INT_MODE); }
@@ -37,88 +471,480 @@
 			  ADCDAT1; }
 #define disable_ts_adc()	{ ADCCON &= ~(ADCCON_READ_START); }
 
-static int adc_state = 0;
-#define	PEN_UP 0
-#define PEN_DOWN 1;
-static int pen_state = PEN_UP;
-static int x, y;
+static int s3c_adc_attach(struct cdata_ts *cdata)
+{
+	int ret;
+
+	/* Enable ADC interrupt */
+	ret = request_irq(IRQ_ADC_DONE, s3c2410_isr_adc, 0, 
+			  "cdata-adc", (void *)cdata);
+	if (ret) goto adc_failed;
+
+	/* Request touch panel IRQ */
+	ret = request_threaded_irq(IRQ_TC, NULL, cdata_ts_handler,
+			IRQF_ONESHOT, "cdata-ts", (void *)cdata);
+	if (ret) goto ts_failed;
+
+	/* Wait for touch screen interrupts */
+	wait_down_int();
 
-static inline void s3c2410_get_XY(void)
+	return 0;
+adc_failed:
+	printk(KERN_ALERT "cdata: request ADC irq failed.\n");
+	return ret;
+ts_failed:
+	free_irq(IRQ_ADC_DONE, (void *)cdata);
+	printk(KERN_ALERT "cdata: request TS irq failed.\n");
+	return ret;
+}
+
+static void s3c_adc_detach(struct cdata_ts *cdata)
 {
-	if (adc_state == 0) { 
-		adc_state = 1;
-		disable_ts_adc();
-		y = (ADCDAT0 & 0x3ff); 
-		mode_y_axis();
-		start_adc_y();
-	} else if (adc_state == 1) { 
-		adc_state = 0;
-		disable_ts_adc();
-		x = (ADCDAT1 & 0x3ff); 
-		pen_state = PEN_DOWN;
-		wait_up_int();
+	free_irq(IRQ_TC, (void *)cdata);
+	hrtimer_cancel(&cdata->timer);
+	free_irq(IRQ_ADC_DONE, (void *)cdata);
+}
+
+static void s3c_adc_wait_down(struct cdata_ts *cdata)
+{
+	wait_down_int();
+}
+
+static void s3c_adc_wait_up(struct cdata_ts *cdata)
+{
+	wait_up_int();
+}
+
+static void s3c_adc_start(struct cdata_ts *cdata, int axis)
+{
+	if (axis == 0) {
+	    mode_x_axis();
+	    start_adc_x();
+	} else {
+	    mode_y_axis();
+	    start_adc_y();
 	}
 }
 
-void cdata_bh(unsigned long);
-DECLARE_TASKLET(my_tasklet, cdata_bh, NULL);
+static int s3c_adc_read(struct cdata_ts *cdata, int axis)
+{
+	disable_ts_adc();
+	return (axis ? ADCDAT1 : ADCDAT0) & 0x3ff;
+}
 
-struct cdata_ts {
-	struct input_dev ts_input;
-	int x;
-	int y;
+static const struct cdata_ts_ops s3c_adc_ops = {
+	name:		"s3c2410",
+	attach:		s3c_adc_attach,
+	detach:		s3c_adc_detach,
+	wait_down:	s3c_adc_wait_down,
+	wait_up:	s3c_adc_wait_up,
+	start:		s3c_adc_start,
+	read:		s3c_adc_read,
 };
 
-void cdata_ts_handler(int irq, void *priv, struct pt_regs *reg);
+#endif
 
-static int ts_input_open(struct input_dev *dev)
-{	
-	struct cdata_ts *cdata = (struct cdata_ts *)dev->private;
+/************************ simulated ADC ******************************/
+
+/*
+ * With sim=1 (always, off the S3C2410) the ADC is a platform device,
+ * cdata-ts-sim, replaying a pen trace on an hrtimer.  A trace is a
+ * list of points held for some microseconds each and loops forever;
+ * the default one is a diagonal stroke.  Writing "x y down us" lines
+ * to its trace attribute appends recorded points, "reset" goes back
+ * to the default.  Its latency attribute reads, and on any write
+ * clears, the ADC-interrupt-to-input_sync() times.
+ */
+static bool sim;
+module_param(sim, bool, 0444);
+MODULE_PARM_DESC(sim, "replay pen traces instead of using the S3C2410 ADC");
+
+static int sim_conv_us = 20;
+module_param(sim_conv_us, int, 0644);
+MODULE_PARM_DESC(sim_conv_us, "simulated conversion time, us");
+
+static int sim_noise = 4;
+module_param(sim_noise, int, 0644);
+MODULE_PARM_DESC(sim_noise, "simulated ADC noise, +/- counts");
+
+#define	TS_SIM_TRACE	4096
+
+struct ts_sim_point {
+	s16 x;
+	s16 y;
+	u16 down;
+	u16 us;
+};
+
+static struct ts_sim {
+	struct platform_device *pdev;
+	struct mutex mutex;	/* cdata, trace loading */
+	spinlock_t lock;
+	struct ts_sim_point *trace;
+	int len;
+	int recorded;		/* trace came from userspace */
+	int pos;
+	int down;		/* pen state at pos */
+	int armed;		/* edge wanted: 1 down, 0 up, -1 none */
+	int stopping;		/* detaching, no more edges */
+	int axis;		/* being converted */
+	u32 seed;
+
+	struct hrtimer step;	/* walks the trace */
+	struct hrtimer conv;	/* conversion done */
+	struct work_struct edge;	/* the pen irq thread */
+	struct cdata_ts *cdata;
+} ts_sim;
+
+static void ts_sim_default(void)
+{
+	struct ts_sim_point *p = ts_sim.trace;
+	int i;
+
+	/* 200 points 2 ms apart, then lifted for 50 ms */
+	for (i = 0; i < 200; i++, p++) {
+	    p->x = 200 + i*3;
+	    p->y = 300 + i*2;
+	    p->down = 1;
+	    p->us = 2000;
+	}
+	p->x = p->y = 0;
+	p->down = 0;
+	p->us = 50000;
+
+	ts_sim.len = 201;
+	ts_sim.recorded = 0;
+	ts_sim.pos = 0;
 }
 
-static int ts_input_close(struct input_dev *dev)
+/* Called with ts_sim.lock held */
+static void ts_sim_check_edge(void)
 {
+	if (!ts_sim.stopping && ts_sim.armed == ts_sim.down) {
+	    ts_sim.armed = -1;
+	    schedule_work(&ts_sim.edge);
+	}
 }
 
-void cdata_ts_handler(int irq, void *priv, struct pt_regs *reg)
+static void ts_sim_edge(struct work_struct *work)
 {
-	struct cdata_ts *cdata = (struct cdata_ts *)priv;
+	if (ts_sim.cdata)
+	    cdata_ts_handler(0, ts_sim.cdata);
+}
 
-	/* read (x,y) from ADC */
-	if (pen_state == PEN_UP) { /* NOW is down */
-	    adc_state = 0;
-	    mode_x_axis();
-	    start_adc_x();
-	} else { /* NOW is up */
-	    pen_state = PEN_UP;
-	    wait_down_int();
+static enum hrtimer_restart ts_sim_step(struct hrtimer *timer)
+{
+	struct ts_sim_point *p;
+	unsigned long flags;
+	int us;
+
+	spin_lock_irqsave(&ts_sim.lock, flags);
+	ts_sim.pos = (ts_sim.pos + 1) % ts_sim.len;
+	p = &ts_sim.trace[ts_sim.pos];
+	ts_sim.down = p->down;
+	us = p->us;
+	ts_sim_check_edge();
+	spin_unlock_irqrestore(&ts_sim.lock, flags);
 
-	    my_tasklet.data = (unsigned long)cdata;
-	    tasklet_schedule(&my_tasklet);
+	hrtimer_forward_now(timer, ns_to_ktime((u64)us * NSEC_PER_USEC));
+
+	return HRTIMER_RESTART;
+}
+
+static enum hrtimer_restart ts_sim_conv(struct hrtimer *timer)
+{
+	if (ts_sim.cdata)
+	    s3c2410_isr_adc(0, ts_sim.cdata);
+
+	return HRTIMER_NORESTART;
+}
+
+static int ts_sim_attach(struct cdata_ts *cdata)
+{
+	unsigned long flags;
+
+	mutex_lock(&ts_sim.mutex);
+	if (ts_sim.cdata) {
+	    mutex_unlock(&ts_sim.mutex);
+	    return -EBUSY;
 	}
+	ts_sim.cdata = cdata;
+
+	spin_lock_irqsave(&ts_sim.lock, flags);
+	ts_sim.stopping = 0;
+	ts_sim.pos = 0;
+	ts_sim.down = ts_sim.trace[0].down;
+	ts_sim.armed = 1;
+	ts_sim_check_edge();
+	spin_unlock_irqrestore(&ts_sim.lock, flags);
+
+	hrtimer_start(&ts_sim.step,
+		ns_to_ktime((u64)ts_sim.trace[0].us * NSEC_PER_USEC),
+		HRTIMER_MODE_REL);
+	mutex_unlock(&ts_sim.mutex);
+
+	return 0;
 }
 
-void cdata_bh(unsigned long priv)
+static void ts_sim_detach(struct cdata_ts *cdata)
 {
-	struct cdata_ts *cdata = (struct cdata_ts *)priv;
-	struct input_dev *dev = &cdata->ts_input;
-	spinlock_t lock;
-	int x, y;
 	unsigned long flags;
 
-	spin_lock_irqsave(&lock, flags);
-	x = cdata->x;
-	y = cdata->y;
-	spin_unlock_irqsave(&lock, flags);
+	mutex_lock(&ts_sim.mutex);
+	spin_lock_irqsave(&ts_sim.lock, flags);
+	ts_sim.stopping = 1;
+	ts_sim.armed = -1;
+	spin_unlock_irqrestore(&ts_sim.lock, flags);
+
+	hrtimer_cancel(&ts_sim.step);
+	cancel_work_sync(&ts_sim.edge);
+	hrtimer_cancel(&cdata->timer);
+	hrtimer_cancel(&ts_sim.conv);
+
+	ts_sim.cdata = NULL;
+	mutex_unlock(&ts_sim.mutex);
+}
+
+static void ts_sim_wait_down(struct cdata_ts *cdata)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ts_sim.lock, flags);
+	ts_sim.armed = 1;
+	ts_sim_check_edge();
+	spin_unlock_irqrestore(&ts_sim.lock, flags);
+}
+
+static void ts_sim_wait_up(struct cdata_ts *cdata)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ts_sim.lock, flags);
+	ts_sim.armed = 0;
+	ts_sim_check_edge();
+	spin_unlock_irqrestore(&ts_sim.lock, flags);
+}
+
+static void ts_sim_start(struct cdata_ts *cdata, int axis)
+{
+	ts_sim.axis = axis;
+	hrtimer_start(&ts_sim.conv,
+		ns_to_ktime((u64)max(sim_conv_us, 1) * NSEC_PER_USEC),
+		HRTIMER_MODE_REL);
+}
+
+/* axis 0 lands in y, as ADCDAT0 does on the board */
+static int ts_sim_read(struct cdata_ts *cdata, int axis)
+{
+	struct ts_sim_point *p;
+	unsigned long flags;
+	int v, n;
+
+	spin_lock_irqsave(&ts_sim.lock, flags);
+	p = &ts_sim.trace[ts_sim.pos];
+	v = axis ? p->x : p->y;
+	ts_sim.seed = ts_sim.seed * 1103515245 + 12345;
+	n = clamp(sim_noise, 0, 255);
+	if (n)
+	    v += (int)((ts_sim.seed >> 16) % (2*n + 1)) - n;
+	spin_unlock_irqrestore(&ts_sim.lock, flags);
+
+	return clamp(v, 0, 0x3ff);
+}
+
+static const struct cdata_ts_ops ts_sim_ops = {
+	name:		"sim",
+	attach:		ts_sim_attach,
+	detach:		ts_sim_detach,
+	wait_down:	ts_sim_wait_down,
+	wait_up:	ts_sim_wait_up,
+	start:		ts_sim_start,
+	read:		ts_sim_read,
+};
+
+static ssize_t ts_sim_trace_store(struct device *dev,
+			struct device_attribute *attr,
+			const char *buf, size_t count)
+{
+	struct ts_sim_point *pts, *pt;
+	const char *p = buf, *end = buf + count;
+	int x, y, down, us, used, n = 0, base;
+	ssize_t ret = count;
+
+	if (sysfs_streq(buf, "reset")) {
+	    mutex_lock(&ts_sim.mutex);
+	    if (ts_sim.cdata)
+		ret = -EBUSY;
+	    else
+		ts_sim_default();
+	    mutex_unlock(&ts_sim.mutex);
+	    return ret;
+	}
+
+	/* a line is at least "0 0 0 1\n"; parse it all before using any */
+	pts = kmalloc((count / 8 + 1) * sizeof(struct ts_sim_point),
+			GFP_KERNEL);
+	if (!pts)
+	    return -ENOMEM;
+
+	for (;;) {
+	    while (p < end && isspace(*p))
+		p++;
+	    if (p == end)
+		break;
+
+	    if (sscanf(p, "%d %d %d %d%n", &x, &y, &down, &us, &used) != 4) {
+		ret = -EINVAL;
+		goto out;
+	    }
+	    p += used;
+
+	    pt = &pts[n++];
+	    pt->x = clamp(x, 0, 0x3ff);
+	    pt->y = clamp(y, 0, 0x3ff);
+	    pt->down = !!down;
+	    pt->us = clamp(us, 1, 65535);
+	}
+
+	if (!n)
+	    goto out;
+
+	mutex_lock(&ts_sim.mutex);
+	/* the first write after the default replaces it */
+	base = ts_sim.recorded ? ts_sim.len : 0;
+	if (ts_sim.cdata) {
+	    /* replaying; the timers own the trace */
+	    ret = -EBUSY;
+	} else if (base + n > TS_SIM_TRACE) {
+	    ret = -ENOSPC;
+	} else {
+	    memcpy(ts_sim.trace + base, pts, n * sizeof(struct ts_sim_point));
+	    ts_sim.len = base + n;
+	    ts_sim.recorded = 1;
+	}
+	mutex_unlock(&ts_sim.mutex);
+
+out:
+	kfree(pts);
+	return ret;
+}
+
+static ssize_t ts_sim_trace_show(struct device *dev,
+			struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%d\n", ts_sim.len);
+}
+
+static DEVICE_ATTR(trace, 0644, ts_sim_trace_show, ts_sim_trace_store);
+
+static ssize_t ts_sim_latency_show(struct device *dev,
+			struct device_attribute *attr, char *buf)
+{
+	struct cdata_ts *cdata;
+	unsigned long flags;
+	u64 sum = 0;
+	u32 n = 0, max = 0;
+
+	mutex_lock(&ts_sim.mutex);
+	cdata = ts_sim.cdata;
+	if (cdata) {
+	    spin_lock_irqsave(&cdata->lock, flags);
+	    sum = cdata->lat_sum;
+	    n = cdata->lat_n;
+	    max = cdata->lat_max;
+	    spin_unlock_irqrestore(&cdata->lock, flags);
+	}
+	mutex_unlock(&ts_sim.mutex);
+
+	return sprintf(buf, "frames %u avg %llu ns max %u ns\n", n,
+			n ? div_u64(sum, n) : 0ULL, max);
+}
+
+static ssize_t ts_sim_latency_store(struct device *dev,
+			struct device_attribute *attr,
+			const char *buf, size_t count)
+{
+	struct cdata_ts *cdata;
+	unsigned long flags;
+
+	mutex_lock(&ts_sim.mutex);
+	cdata = ts_sim.cdata;
+	if (cdata) {
+	    spin_lock_irqsave(&cdata->lock, flags);
+	    cdata->lat_sum = 0;
+	    cdata->lat_n = 0;
+	    cdata->lat_max = 0;
+	    spin_unlock_irqrestore(&cdata->lock, flags);
+	}
+	mutex_unlock(&ts_sim.mutex);
+
+	return count;
+}
+
+static DEVICE_ATTR(latency, 0644, ts_sim_latency_show, ts_sim_latency_store);
+
+static int ts_sim_init(void)
+{
+	int ret;
+
+	ts_sim.trace = vmalloc(TS_SIM_TRACE * sizeof(struct ts_sim_point));
+	if (!ts_sim.trace)
+	    return -ENOMEM;
+
+	mutex_init(&ts_sim.mutex);
+	spin_lock_init(&ts_sim.lock);
+	ts_sim_default();
+	ts_sim.armed = -1;
+	ts_sim.seed = 1;
+
+	hrtimer_init(&ts_sim.step, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	ts_sim.step.function = ts_sim_step;
+	hrtimer_init(&ts_sim.conv, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	ts_sim.conv.function = ts_sim_conv;
+	INIT_WORK(&ts_sim.edge, ts_sim_edge);
+
+	ts_sim.pdev = platform_device_register_simple("cdata-ts-sim", -1,
+							NULL, 0);
+	if (IS_ERR(ts_sim.pdev)) {
+	    ret = PTR_ERR(ts_sim.pdev);
+	    goto fail_pdev;
+	}
+
+	ret = device_create_file(&ts_sim.pdev->dev, &dev_attr_trace);
+	if (ret)
+	    goto fail_trace;
+	ret = device_create_file(&ts_sim.pdev->dev, &dev_attr_latency);
+	if (ret)
+	    goto fail_latency;
+
+	return 0;
 
-	input_report_abs(dev, ABS_X, x);
-	input_report_abs(dev, ABS_Y, y);
+fail_latency:
+	device_remove_file(&ts_sim.pdev->dev, &dev_attr_trace);
+fail_trace:
+	platform_device_unregister(ts_sim.pdev);
+fail_pdev:
+	vfree(ts_sim.trace);
+	return ret;
 }
 
-static void s3c2410_isr_adc(int irq, void *dev_id, struct pt_regs *reg) 
+static void ts_sim_exit(void)
 {
-	if (pen_state == PEN_UP)
-	    s3c2410_get_XY();
+	device_remove_file(&ts_sim.pdev->dev, &dev_attr_latency);
+	device_remove_file(&ts_sim.pdev->dev, &dev_attr_trace);
+	platform_device_unregister(ts_sim.pdev);
+	vfree(ts_sim.trace);
+}
+
+/******************************************************/
+
+static const struct cdata_ts_ops *cdata_ts_ops(void)
+{
+#ifdef CONFIG_ARCH_S3C2410
+	if (!sim)
+	    return &s3c_adc_ops;
+#endif
+	return &ts_sim_ops;
 }
 
 static int cdata_ts_open(struct inode *inode, struct file *filp)
@@ -128,54 +954,66 @@ static int cdata_ts_open(struct inode *inode, struct file *filp)
 
     printk(KERN_INFO "cdata_ts_open");
 
-    cdata = kmalloc(sizeof(struct cdata_ts), GFP_KERNEL);
+    cdata = kzalloc(sizeof(struct cdata_ts), GFP_KERNEL);
+    if (!cdata)
+	return -ENOMEM;
 
     /** handling input device ***/
-    cdata->ts_input.name = "cdata-ts";
-    cdata->ts_input.open = ts_input_open;
-    cdata->ts_input.close = ts_input_close;
-    cdata->ts_input.private = (void *)cdata;
+    cdata->input = input_allocate_device();
+    if (!cdata->input) {
+	kfree(cdata);
+	return -ENOMEM;
+    }
+    cdata->input->name = "cdata-ts";
+    cdata->input->open = ts_input_open;
+    cdata->input->close = ts_input_close;
+    input_set_drvdata(cdata->input, cdata);
 
     // Set events
-    cdata->ts_input.evbit[0] = BIT(EV_ABS);
+    cdata->input->evbit[0] = BIT_MASK(EV_ABS) | BIT_MASK(EV_KEY);
     // Set types
-    cdata->ts_input.absbit[0] = BIT(ABS_X) | BIT(ABS_Y);
-
-    input_register_device(&cdata->ts_input);
+    cdata->input->keybit[BIT_WORD(BTN_TOUCH)] = BIT_MASK(BTN_TOUCH);
+    input_set_abs_params(cdata->input, ABS_X, 0, 0x3ff, 0, 0);
+    input_set_abs_params(cdata->input, ABS_Y, 0, 0x3ff, 0, 0);
 
     cdata->x = 0;
     cdata->y = 0;
+    spin_lock_init(&cdata->lock);
+    cdata->ops = cdata_ts_ops();
+    cdata->head = cdata->tail = 0;
+    cdata->down = 0;
+    cdata->adc_busy = 0;
+    ts_filter_reset(&cdata->filter);
 
-    filp->private_data = (void *)cdata;
+    hrtimer_init(&cdata->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    cdata->timer.function = cdata_ts_tick;
 
-	/* Enable ADC interrupt */
-	ret = request_irq(IRQ_ADC_DONE, s3c2410_isr_adc, SA_INTERRUPT, 
-			  "cdata-adc", s3c2410_isr_adc);
-	if (ret) goto adc_failed;
-
-	/* Request touch panel IRQ */
-	ret = request_irq(IRQ_TC, cdata_ts_handler, SA_INTERRUPT, 
-		"cdata-ts", (void *)cdata);
-	if (ret) goto ts_failed;
+    ret = input_register_device(cdata->input);
+    if (ret) {
+	input_free_device(cdata->input);
+	kfree(cdata);
+	return ret;
+    }
 
-	/* Wait for touch screen interrupts */
-	wait_down_int();
+    filp->private_data = (void *)cdata;
 
-	return 0;
-adc_failed:
-	printk(KERN_ALERT "cdata: request ADC irq failed.\n");
-	return ret;
-ts_failed:
-	printk(KERN_ALERT "cdata: request TS irq failed.\n");
+    ret = cdata->ops->attach(cdata);
+    if (ret) {
+	input_unregister_device(cdata->input);
+	kfree(cdata);
 	return ret;
+    }
+
+    return 0;
 }
 
-static ssize_t cdata_ts_read(struct file *filp, char *buf, size_t size, loff_t *off)
+static ssize_t cdata_ts_read(struct file *filp, char __user *buf, size_t size, 
+			loff_t *off)
 {
 	return 0;
 }
 
-static ssize_t cdata_ts_write(struct file *filp, const char *buf, size_t size, 
+static ssize_t cdata_ts_write(struct file *filp, const char __user *buf, size_t size, 
 			loff_t *off)
 {
 	return 0;
@@ -183,11 +1021,18 @@ static ssize_t cdata_ts_write(struct file *filp, const char *buf, size_t size,
 
 static int cdata_ts_close(struct inode *inode, struct file *filp)
 {
+	struct cdata_ts *cdata = (struct cdata_ts *)filp->private_data;
+
+	cdata->ops->detach(cdata);
+
+	input_unregister_device(cdata->input);
+	kfree(cdata);
+
 	return 0;
 }
 
-static int cdata_ts_ioctl(struct inode *inode, struct file *filp, 
-		unsigned int cmd, unsigned long arg)
+static long cdata_ts_ioctl(struct file *filp, unsigned int cmd, 
+		unsigned long arg)
 {
 	return -ENOTTY;
 }
@@ -198,7 +1043,7 @@ static struct file_operations cdata_ts_fops = {
 	release:	cdata_ts_close,
 	read:		cdata_ts_read,
 	write:		cdata_ts_write,
-	ioctl:		cdata_ts_ioctl,
+	unlocked_ioctl:	cdata_ts_ioctl,
 };
 
 #define CDATA_TS_MINOR 39
@@ -211,22 +1056,38 @@ static struct miscdevice cdata_ts_misc = {
 
 int cdata_ts_init_module(void)
 {
-	set_gpio_ctrl(GPIO_YPON); 
-	set_gpio_ctrl(GPIO_YMON);
-	set_gpio_ctrl(GPIO_XPON);
-	set_gpio_ctrl(GPIO_XMON);
+	int ret;
+
+	if (cdata_ts_ops() == &ts_sim_ops) {
+	    ret = ts_sim_init();
+	    if (ret)
+		return ret;
+	} else {
+#ifdef CONFIG_ARCH_S3C2410
+	    set_gpio_ctrl(GPIO_YPON); 
+	    set_gpio_ctrl(GPIO_YMON);
+	    set_gpio_ctrl(GPIO_XPON);
+	    set_gpio_ctrl(GPIO_XMON);
+#endif
+	}
 
 	if (misc_register(&cdata_ts_misc) < 0) {
 	    printk(KERN_INFO "CDATA-TS: can't register driver\n");
+	    if (cdata_ts_ops() == &ts_sim_ops)
+		ts_sim_exit();
 	    return -1;
 	}
-	printk(KERN_INFO "CDATA-TS: cdata_ts_init_module\n");
+	printk(KERN_INFO "CDATA-TS: cdata_ts_init_module, %s ADC\n",
+			cdata_ts_ops()->name);
 	return 0;
 }
 
 void cdata_ts_cleanup_module(void)
 {
-	misc_register(&cdata_ts_misc);
+	misc_deregister(&cdata_ts_misc);
+
+	if (cdata_ts_ops() == &ts_sim_ops)
+	    ts_sim_exit();
 }
 
 module_init(cdata_ts_init_module);
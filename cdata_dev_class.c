@@ -15,36 +15,336 @@
 #include <linux/uaccess.h>
 #include <linux/slab.h>
 #include <linux/device.h>
+#include <linux/idr.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/kref.h>
+#include <linux/rwsem.h>
+#include <linux/poll.h>
+#include <linux/uio.h>
+#include <linux/completion.h>
 #include "cdata_dev_class.h"
 
 /* private data structure */
 struct cdata_dev_data {
-	struct cdata_dev 	*ops;
+	struct cdata_dev 	*ops;	/* NULL once unregistered */
+	struct rw_semaphore	ops_sem;
+	struct kref		ref;	/* registration and open files */
 	struct miscdevice	misc;
 
 	int 			minor;
+	char			name[16];
+
+	/* connect/disconnect dispatch */
+	struct work_struct	work;
+	struct list_head	queue;		/* struct cdata_dev_call, lock */
+	int			state;		/* CDATA_STATE_* */
+	int			live;		/* misc device registered */
+	spinlock_t		lock;		/* queue and the latencies */
+	u64			calls;
+	u64			last_ns;
+	u64			max_ns;
 };
 
-static struct cdata_dev_data *cdata_dev_data[MAX_MINOR];
+/*
+ * One write to the cdata attribute: a call per device, queued in
+ * order on that device, and a count the writer waits on.  Every
+ * write is delivered, however close together they come.
+ */
+struct cdata_dev_batch {
+	struct kref		ref;		/* the writer and each call */
+	atomic_t		pending;	/* calls not run, plus one */
+	struct completion	done;
+};
+
+struct cdata_dev_call {
+	struct list_head	node;
+	int			action;		/* 1 connect, 0 disconnect */
+	struct cdata_dev_batch	*batch;
+};
+
+/*
+ * Registered devices by minor.  Changes and the connect broadcast
+ * are serialized by cdata_dev_lock; other lookups only need
+ * rcu_read_lock().
+ */
+static DEFINE_IDR(cdata_dev_idr);
+static DEFINE_MUTEX(cdata_dev_lock);
+
+/*
+ * Writes to the cdata attribute queue one work item per device and
+ * wait until all of them have run, unless async_connect is set.
+ */
+static bool async_connect;
+module_param(async_connect, bool, 0644);
+MODULE_PARM_DESC(async_connect, "return from a connect write before the callbacks finish");
+
+static struct workqueue_struct *cdata_dev_wq;
+static struct device *cdata_ctl;	/* carries state and states */
+static atomic_t cdata_dev_gen = ATOMIC_INIT(0);
 
 /************************ misc ******************************/
 
+static void cdata_dev_release(struct kref *ref)
+{
+	kfree(container_of(ref, struct cdata_dev_data, ref));
+}
+
+/*
+ * misc_open() holds the misc lock around us and hands over the
+ * miscdevice, so the device cannot be unregistered under our feet.
+ */
 static int cdata_dev_open(struct inode *inode, struct file *filp)
 {
+	struct miscdevice *misc = (struct miscdevice *)filp->private_data;
+	struct cdata_dev_data *data =
+			container_of(misc, struct cdata_dev_data, misc);
+
+	kref_get(&data->ref);
+	filp->private_data = data;
+
 	return 0;
 }
 
 static int cdata_dev_close(struct inode *inode, struct file *filp)
 {
+	struct cdata_dev_data *data =
+			(struct cdata_dev_data *)filp->private_data;
+
+	kref_put(&data->ref, cdata_dev_release);
+
 	return 0;
 }
 
+/*
+ * The data path goes straight to the backend: no buffer, no copy,
+ * only the read side of ops_sem so that unregistering can wait for
+ * calls in flight.
+ */
+static ssize_t cdata_dev_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct cdata_dev_data *data =
+			(struct cdata_dev_data *)iocb->ki_filp->private_data;
+	ssize_t ret = -EINVAL;
+
+	down_read(&data->ops_sem);
+	if (data->ops == NULL)
+	    ret = -ENODEV;
+	else if (data->ops->read)
+	    ret = data->ops->read(data->ops, iocb, to);
+	up_read(&data->ops_sem);
+
+	return ret;
+}
+
+static ssize_t cdata_dev_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct cdata_dev_data *data =
+			(struct cdata_dev_data *)iocb->ki_filp->private_data;
+	ssize_t ret = -EINVAL;
+
+	down_read(&data->ops_sem);
+	if (data->ops == NULL)
+	    ret = -ENODEV;
+	else if (data->ops->write)
+	    ret = data->ops->write(data->ops, iocb, from);
+	up_read(&data->ops_sem);
+
+	return ret;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,16,0)
+/*
+ * Before read_iter/write_iter: wrap the caller's iovec in an iov_iter
+ * so the backend hooks see the same thing on every kernel.
+ */
+static ssize_t cdata_dev_aio_read(struct kiocb *iocb, const struct iovec *iov,
+			unsigned long nr_segs, loff_t pos)
+{
+	struct iov_iter to;
+
+	iov_iter_init(&to, iov, nr_segs, iov_length(iov, nr_segs), 0);
+
+	return cdata_dev_read_iter(iocb, &to);
+}
+
+static ssize_t cdata_dev_aio_write(struct kiocb *iocb, const struct iovec *iov,
+			unsigned long nr_segs, loff_t pos)
+{
+	struct iov_iter from;
+
+	iov_iter_init(&from, iov, nr_segs, iov_length(iov, nr_segs), 0);
+
+	return cdata_dev_write_iter(iocb, &from);
+}
+#endif
+
+static int cdata_dev_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct cdata_dev_data *data =
+			(struct cdata_dev_data *)filp->private_data;
+	int ret = -ENODEV;
+
+	down_read(&data->ops_sem);
+	if (data->ops && data->ops->mmap)
+	    ret = data->ops->mmap(data->ops, filp, vma);
+	up_read(&data->ops_sem);
+
+	return ret;
+}
+
+static unsigned int cdata_dev_poll(struct file *filp, poll_table *wait)
+{
+	struct cdata_dev_data *data =
+			(struct cdata_dev_data *)filp->private_data;
+	unsigned int mask;
+
+	down_read(&data->ops_sem);
+	if (data->ops == NULL)
+	    mask = POLLERR | POLLHUP;
+	else if (data->ops->poll)
+	    mask = data->ops->poll(data->ops, filp, wait);
+	else
+	    mask = DEFAULT_POLLMASK;
+	up_read(&data->ops_sem);
+
+	return mask;
+}
+
 static struct file_operations cdata_dev_fops = {
 	owner:		THIS_MODULE,
 	open:		cdata_dev_open,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,16,0)
+	read:		do_sync_read,
+	write:		do_sync_write,
+	aio_read:	cdata_dev_aio_read,
+	aio_write:	cdata_dev_aio_write,
+#else
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,1,0)
+	read:		new_sync_read,
+	write:		new_sync_write,
+#endif
+	read_iter:	cdata_dev_read_iter,
+	write_iter:	cdata_dev_write_iter,
+#endif
+	mmap:		cdata_dev_mmap,
+	poll:		cdata_dev_poll,
 	release:	cdata_dev_close,
 };
 
+/************************ dispatch ******************************/
+
+/* the states table changed; tell pollers and, for a device, udev */
+static void cdata_dev_notify(struct cdata_dev_data *data)
+{
+	char minor[24], state[24];
+	char *envp[] = { minor, state, NULL };
+
+	atomic_inc(&cdata_dev_gen);
+	if (cdata_ctl)
+	    sysfs_notify(&cdata_ctl->kobj, NULL, "state");
+
+	if (data && data->live) {
+	    snprintf(minor, sizeof(minor), "CDATA_MINOR=%d", data->minor);
+	    snprintf(state, sizeof(state), "CDATA_STATE=%s",
+	    		data->state == CDATA_STATE_CONNECTED ?
+			"connected" : "disconnected");
+	    kobject_uevent_env(&data->misc.this_device->kobj, KOBJ_CHANGE,
+	    			envp);
+	}
+}
+
+static void cdata_dev_batch_free(struct kref *ref)
+{
+	kfree(container_of(ref, struct cdata_dev_batch, ref));
+}
+
+static void cdata_dev_batch_put(struct cdata_dev_batch *batch)
+{
+	if (atomic_dec_and_test(&batch->pending))
+	    complete(&batch->done);
+	kref_put(&batch->ref, cdata_dev_batch_free);
+}
+
+static void cdata_dev_call(struct cdata_dev_data *data, int action)
+{
+	struct cdata_dev *ops = data->ops;
+	int ret = 0;
+	ktime_t t0;
+	u64 ns;
+
+	t0 = ktime_get();
+	if (action == 0) {
+	    if (ops->disconnect)
+		ret = ops->disconnect(ops);
+	} else {
+	    if (ops->connect)
+		ret = ops->connect(ops);
+	}
+	ns = ktime_to_ns(ktime_sub(ktime_get(), t0));
+
+	if (ret == 0 && data->state != action) {
+	    data->state = action;
+	    cdata_dev_notify(data);
+	}
+
+	spin_lock(&data->lock);
+	data->calls++;
+	data->last_ns = ns;
+	if (ns > data->max_ns)
+	    data->max_ns = ns;
+	spin_unlock(&data->lock);
+}
+
+static void cdata_dev_dispatch(struct work_struct *work)
+{
+	struct cdata_dev_data *data =
+			container_of(work, struct cdata_dev_data, work);
+	struct cdata_dev_call *call;
+
+	for (;;) {
+	    spin_lock(&data->lock);
+	    call = list_first_entry_or_null(&data->queue,
+	    			struct cdata_dev_call, node);
+	    if (call)
+		list_del(&call->node);
+	    spin_unlock(&data->lock);
+
+	    if (call == NULL)
+		break;
+
+	    cdata_dev_call(data, call->action);
+	    cdata_dev_batch_put(call->batch);
+	    kfree(call);
+	}
+}
+
+/*
+ * calls, last and worst callback time in us, in the device's own
+ * directory so that any number of devices can be read
+ */
+static ssize_t cdata_dev_show_latency(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct miscdevice *misc = (struct miscdevice *)dev_get_drvdata(dev);
+	struct cdata_dev_data *data =
+			container_of(misc, struct cdata_dev_data, misc);
+	u64 calls, last, max;
+
+	spin_lock(&data->lock);
+	calls = data->calls;
+	last = data->last_ns;
+	max = data->max_ns;
+	spin_unlock(&data->lock);
+
+	return sprintf(buf, "%llu %llu %llu\n", calls,
+			div_u64(last, NSEC_PER_USEC), div_u64(max, NSEC_PER_USEC));
+}
+
+static DEVICE_ATTR(latency, 0444, cdata_dev_show_latency, NULL);
+
 /******************************************************/
 
 int cdata_device_register(struct cdata_dev *ops)
@@ -52,39 +352,77 @@ int cdata_device_register(struct cdata_dev *ops)
 	int ret;
 	int minor;
 	struct cdata_dev_data *data;
-	char name[16];
 
-	ret = -1;
+	ret = -EINVAL;
 
 	if (ops == NULL)
 	    goto fail1;
 
 	minor = ops->minor;
-	if (minor > MAX_MINOR)
-	    goto fail1;
-
-	data = cdata_dev_data[minor];
-	if (data != NULL)
+	if (minor >= CDATA_MAX_DEVICES || minor < CDATA_DYNAMIC_MINOR)
 	    goto fail1;
 
+	ret = -ENOMEM;
 	data = (struct cdata_dev_data *)
-	            kmalloc(sizeof(struct cdata_dev_data), GFP_KERNEL);
-	memset(data, 0, sizeof(struct cdata_dev_data));
+	            kzalloc(sizeof(struct cdata_dev_data), GFP_KERNEL);
+	if (data == NULL)
+	    goto fail1;
 
 	data->ops = ops;
+	data->state = CDATA_STATE_DISCONNECTED;
+	init_rwsem(&data->ops_sem);
+	kref_init(&data->ref);
+	INIT_WORK(&data->work, cdata_dev_dispatch);
+	INIT_LIST_HEAD(&data->queue);
+	spin_lock_init(&data->lock);
+
+	/* claim the minor before anyone can see the device */
+	mutex_lock(&cdata_dev_lock);
+	if (minor == CDATA_DYNAMIC_MINOR)
+	    ret = idr_alloc(&cdata_dev_idr, data, 0, CDATA_MAX_DEVICES,
+	    			GFP_KERNEL);
+	else
+	    ret = idr_alloc(&cdata_dev_idr, data, minor, minor+1, GFP_KERNEL);
+	mutex_unlock(&cdata_dev_lock);
+
+	if (ret < 0)
+	    goto fail2;
+
+	minor = ret;
 	data->minor = minor;
-	cdata_dev_data[minor] = data;
+	ops->minor = minor;
 
-	sprintf(name, "cdata%d\n", minor);
-	data->misc.minor = 20+minor; 
-	data->misc.name = name;
+	snprintf(data->name, sizeof(data->name), "cdata%d", minor);
+	data->misc.minor = MISC_DYNAMIC_MINOR;
+	data->misc.name = data->name;
 	data->misc.fops = &cdata_dev_fops;
 
-	misc_register(&data->misc);
-	printk(KERN_ALERT "cdata_dev: registering %s to misc\n", name);
+	ret = misc_register(&data->misc);
+	if (ret)
+	    goto fail3;
+
+	/* misc_register() makes the miscdevice the node's drvdata */
+	ret = device_create_file(data->misc.this_device, &dev_attr_latency);
+	if (ret)
+	    goto fail4;
+
+	data->live = 1;
+	printk(KERN_ALERT "cdata_dev: registering %s to misc\n", data->name);
+
+	cdata_dev_notify(NULL);
 
 	return 0;
 
+fail4:
+	misc_deregister(&data->misc);
+fail3:
+	mutex_lock(&cdata_dev_lock);
+	idr_remove(&cdata_dev_idr, minor);
+	mutex_unlock(&cdata_dev_lock);
+	synchronize_rcu();
+	flush_work(&data->work);
+fail2:
+	kfree(data);
 fail1:
 	printk(KERN_ALERT "cdata_dev: register failed.\n");
 	return ret;
@@ -96,11 +434,32 @@ int cdata_device_unregister(struct cdata_dev *ops)
 	struct cdata_dev_data *data;
 
 	minor = ops->minor;
-	data = cdata_dev_data[minor];
 
+	mutex_lock(&cdata_dev_lock);
+	data = idr_find(&cdata_dev_idr, minor);
+	if (data == NULL || data->ops != ops) {
+	    mutex_unlock(&cdata_dev_lock);
+	    return -EINVAL;
+	}
+	idr_remove(&cdata_dev_idr, minor);
+	mutex_unlock(&cdata_dev_lock);
+
+	/* wait out any connect broadcast that still sees it */
+	synchronize_rcu();
+	flush_work(&data->work);
+
+	data->live = 0;
+	device_remove_file(data->misc.this_device, &dev_attr_latency);
 	misc_deregister(&data->misc);
-	
-	kfree(data);
+
+	cdata_dev_notify(NULL);
+
+	/* no hook in flight, and none from files still open */
+	down_write(&data->ops_sem);
+	data->ops = NULL;
+	up_write(&data->ops_sem);
+
+	kref_put(&data->ref, cdata_dev_release);
 
 	return 0;
 }
@@ -116,60 +475,139 @@ static ssize_t cdata_handle_connect(struct class *cls, struct class_attribute *a
             				const char *buf, size_t count)
 {
 	struct cdata_dev_data *data;
-	struct cdata_dev *ops;
-	char str[1];
+	struct cdata_dev_batch *batch;
+	struct cdata_dev_call *call;
+	ssize_t ret = count;
 	int v;
 	int i;
 
-	memcpy(str, buf, 1);
+	if (count < 1)
+	    return -EINVAL;
 
 	/* atoi */
-	v = str[0];
-	v = v - '0';
-	
-	if ((v != 0) || (v != 1))
-	    return 0;
-
-	printk(KERN_ALERT "cdata_dev: connect_enable = %d\n", v);
+	v = buf[0] - '0';
 
-	/** callback connect */
-	for (i = 0; i < MAX_MINOR; i++) {
-	    data = cdata_dev_data[i];
+	if ((v != 0) && (v != 1))
+	    return -EINVAL;
 
-	    if (data == NULL)
-		continue;
+	printk(KERN_ALERT "cdata_dev: connect_enable = %d\n", v);
 
-	    ops = data->ops;
-	    if (v == 0) {
-	        if (ops && ops->disconnect) 
-		    ops->disconnect(ops);
-	    } else {
-	        if (ops && ops->connect) 
-		    ops->connect(ops);
+	batch = kmalloc(sizeof(struct cdata_dev_batch), GFP_KERNEL);
+	if (batch == NULL)
+	    return -ENOMEM;
+	kref_init(&batch->ref);
+	atomic_set(&batch->pending, 1);
+	init_completion(&batch->done);
+
+	/** callback connect, every device at once */
+	mutex_lock(&cdata_dev_lock);
+	idr_for_each_entry(&cdata_dev_idr, data, i) {
+	    call = kmalloc(sizeof(struct cdata_dev_call), GFP_KERNEL);
+	    if (call == NULL) {
+		ret = -ENOMEM;
+		break;
 	    }
+	    call->action = v;
+	    call->batch = batch;
+	    kref_get(&batch->ref);
+	    atomic_inc(&batch->pending);
+
+	    spin_lock(&data->lock);
+	    list_add_tail(&call->node, &data->queue);
+	    spin_unlock(&data->lock);
+	    /* already queued or running: it will find the call */
+	    queue_work(cdata_dev_wq, &data->work);
 	}
+	mutex_unlock(&cdata_dev_lock);
 
-	return 0;
+	/*
+	 * Calls are queued now and will run whatever happens here, so a
+	 * signal only ends the wait; restarting would queue them twice.
+	 */
+	if (atomic_dec_and_test(&batch->pending))
+	    complete(&batch->done);
+	else if (!async_connect)
+	    wait_for_completion_interruptible(&batch->done);
+
+	kref_put(&batch->ref, cdata_dev_batch_free);
+
+	return ret;
 }
 
 static CLASS_ATTR(cdata, 0666, cdata_show_version, cdata_handle_connect);
 
+/* bumped on every change of states; poll() it, then read states */
+static ssize_t cdata_show_state(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", atomic_read(&cdata_dev_gen));
+}
+
+static DEVICE_ATTR(state, 0444, cdata_show_state, NULL);
+
+static ssize_t cdata_read_states(struct file *filp, struct kobject *kobj,
+		struct bin_attribute *attr, char *buf, loff_t off, size_t count)
+{
+	struct cdata_dev_data *data;
+	int i;
+
+	memset(buf, CDATA_STATE_NONE, count);
+
+	rcu_read_lock();
+	idr_for_each_entry(&cdata_dev_idr, data, i) {
+	    if (i >= off && i < off + count)
+		buf[i - off] = ACCESS_ONCE(data->state);
+	}
+	rcu_read_unlock();
+
+	return count;
+}
+
+static struct bin_attribute cdata_states_attr = {
+	attr:		{ name: "states", mode: 0444 },
+	size:		CDATA_MAX_DEVICES,
+	read:		cdata_read_states,
+};
+
 static struct class *cdata_class;
 
 static int __init cdata_dev_init(void)
 {
+	cdata_dev_wq = alloc_workqueue("cdata_dev", WQ_UNBOUND, 0);
+	if (!cdata_dev_wq)
+	    return -ENOMEM;
+
 	cdata_class = class_create(THIS_MODULE, "cdata_android");
 
 	class_create_file(cdata_class, &class_attr_cdata);
 
+	/* a class has no attribute that poll() works on, so add a device */
+	cdata_ctl = device_create(cdata_class, NULL, MKDEV(0, 0), NULL,
+					"control");
+	if (IS_ERR(cdata_ctl)) {
+	    cdata_ctl = NULL;
+	} else {
+	    device_create_file(cdata_ctl, &dev_attr_state);
+	    device_create_bin_file(cdata_ctl, &cdata_states_attr);
+	}
+
 	return 0;
 }
 
 static void __exit cdata_dev_exit(void)
 {
+	if (cdata_ctl) {
+	    device_remove_bin_file(cdata_ctl, &cdata_states_attr);
+	    device_remove_file(cdata_ctl, &dev_attr_state);
+	    device_unregister(cdata_ctl);
+	}
+
 	class_remove_file(cdata_class, &class_attr_cdata);
 
 	class_destroy(cdata_class);
+
+	idr_destroy(&cdata_dev_idr);
+
+	destroy_workqueue(cdata_dev_wq);
 }
 
 module_init(cdata_dev_init);
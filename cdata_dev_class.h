@@ -1,14 +1,56 @@
 #ifndef	__CDATA_DEV_CLASS_H__
 #define	__CDATA_DEV_CLASS_H__
 
-#define	MAX_MINOR	15
+/* minors handed out by the registry, minor -1 asks for any free one */
+#define	CDATA_MAX_DEVICES	(65536)
+#define	CDATA_DYNAMIC_MINOR	(-1)
 
+/*
+ * Connection state, one byte per minor, as read from
+ * /sys/class/cdata_android/control/states.  control/state counts the
+ * changes and can be poll()ed for POLLPRI; every change also sends a
+ * KOBJ_CHANGE uevent with CDATA_MINOR and CDATA_STATE for the device.
+ * A device changes state when its connect or disconnect hook returns 0.
+ * Each device's latency attribute, /sys/class/misc/cdataN/latency,
+ * reads its hook calls and the last and worst call time in us.
+ */
+#define	CDATA_STATE_DISCONNECTED	0
+#define	CDATA_STATE_CONNECTED		1
+#define	CDATA_STATE_NONE		0xff	/* no such minor */
+
+struct file;
+struct kiocb;
+struct iov_iter;
+struct vm_area_struct;
+struct poll_table_struct;
+
+/*
+ * connect and disconnect run from an unbound workqueue, every device
+ * in parallel, and may sleep.  Calls for one device never overlap.
+ *
+ * read, write, mmap and poll are what the class device node does;
+ * any of them may be NULL.  The iov_iter is the caller's, untouched,
+ * so a backend can copy straight to or from user memory or pin it;
+ * before 3.16 it wraps the iovec handed to aio_read/aio_write.
+ * A hook that blocks holds off cdata_device_unregister() until it
+ * returns, so backends wake their sleepers before unregistering.
+ *
+ * Once cdata_device_unregister() returns, none of the hooks is
+ * running or will be called again; files still open get -ENODEV.
+ */
 struct cdata_dev {
 	int 	minor;
 
 	int 	(*connect)(struct cdata_dev *);
 	int 	(*disconnect)(struct cdata_dev *);
 
+	ssize_t	(*read)(struct cdata_dev *, struct kiocb *, struct iov_iter *);
+	ssize_t	(*write)(struct cdata_dev *, struct kiocb *, struct iov_iter *);
+	int	(*mmap)(struct cdata_dev *, struct file *,
+			struct vm_area_struct *);
+	unsigned int	(*poll)(struct cdata_dev *, struct file *,
+			struct poll_table_struct *);
+
 	void	*private;
 };
 
@@ -12,4 +12,231 @@
 #define	CDATA_BLACK	_IO(0xCE, 5)
 #define	CDATA_WHITE	_IO(0xCE, 6)
 
+/*
+ * cdata-fb: pixel format of the data written to the device.  Changing
+ * the format clears the screen.
+ *
+ *   XRGB8888	4 bytes/pixel, B G R X in memory (the panel format)
+ *   RGB565	2 bytes/pixel, little-endian 5:6:5
+ *   RGB888	3 bytes/pixel, B G R in memory
+ *   C8		1 byte/pixel, index into a 256-entry palette
+ */
+#define	CDATA_FMT_XRGB8888	0
+#define	CDATA_FMT_RGB565	1
+#define	CDATA_FMT_RGB888	2
+#define	CDATA_FMT_C8		3
+
+#define	CDATA_SET_FORMAT	_IOW(0xCE, 7, int)
+
+/*
+ * cdata-fb keeps a virtual frame taller than the panel.  CDATA_PAN
+ * takes the frame row to show at the top of the panel; the window
+ * wraps around the end of the frame unless the driver pans in
+ * hardware.  Clients that mmap() report what they drew with
+ * CDATA_FLUSH.
+ */
+struct cdata_rect {
+	unsigned int	x, y;
+	unsigned int	w, h;
+};
+
+#define	CDATA_PAN	_IOW(0xCE, 8, int)
+#define	CDATA_FLUSH	_IOW(0xCE, 9, struct cdata_rect)
+
+/*
+ * Every open of cdata-fb draws into its own layer: write(), mmap(),
+ * CDATA_FLUSH and the colour ioctls all address the caller's layer.
+ * A new layer covers the whole virtual frame at z 0 and stays hidden
+ * until the client draws into it.  Layers with a higher z are drawn
+ * on top; alpha (0-255) blends the whole layer when the frame format
+ * is XRGB8888.
+ *
+ * write() stores at the file position, pwrite() at its offset, both
+ * in bytes into the layer.  A write stops short at the end of the
+ * layer and fails with ENOSPC at or past it; lseek() with SEEK_END
+ * is relative to that end.  The format, layer and colour
+ * ioctls move the file position back to 0, CDATA_CLEAR to the end of
+ * what it cleared.
+ */
+struct cdata_layer_info {
+	int		x, y;
+	unsigned int	w, h;
+	int		z;
+	unsigned int	alpha;
+};
+
+#define	CDATA_SET_LAYER	_IOW(0xCE, 10, struct cdata_layer_info)
+
+/*
+ * cdata-iomem: where the flush work of this open runs.  cpu is used by
+ * CDATA_CPU_FIXED, mask (bit n for CPU n) by CDATA_CPU_LEAST_LOADED.
+ * An unknown policy, an offline cpu or a mask with no online CPU in it
+ * fails with EINVAL.
+ */
+#define	CDATA_CPU_WRITER	0
+#define	CDATA_CPU_FIXED		1
+#define	CDATA_CPU_UNBOUND	2
+#define	CDATA_CPU_LEAST_LOADED	3
+
+struct cdata_placement {
+	int		policy;
+	int		cpu;
+	unsigned long	mask;
+};
+
+#define	CDATA_SET_PLACEMENT	_IOW(0xCE, 11, struct cdata_placement)
+
+/*
+ * cdata-iomem: CDATA_EMPTY drops what has been written since the last
+ * flush, CDATA_SYNC prints it, CDATA_WRITE appends the char arg points
+ * to.
+ */
+#define	CDATA_EMPTY		_IO(0xCE, 19)
+#define	CDATA_SYNC		_IO(0xCE, 20)
+#define	CDATA_WRITE		_IOW(0xCE, 21, char)
+
+/*
+ * cdata-fb: clockwise rotation of the frame on the panel, 0, 90, 180
+ * or 270 degrees.  At 90 and 270 the frame is 320x240 and the virtual
+ * frame is shorter by the same ratio.  Clears the frame and moves it
+ * back to yoffset 0.
+ */
+#define	CDATA_SET_ROTATE	_IOW(0xCE, 12, int)
+
+/*
+ * cdata-fb: load count entries of the CDATA_FMT_C8 palette from start
+ * on, as 0x00RRGGBB.  The palette starts out as RGB 3:3:2 and is only
+ * applied at flush time, so loading one repaints the screen without
+ * touching the indexed pixels.
+ */
+struct cdata_palette {
+	unsigned int	start;
+	unsigned int	count;
+	unsigned int	color[256];
+};
+
+#define	CDATA_SET_PALETTE	_IOW(0xCE, 13, struct cdata_palette)
+
+/*
+ * cdata-fb: capture the composed virtual frame.  CDATA_SNAPSHOT waits
+ * for the compositor to publish a copy of the frame as it is between
+ * two compositions and fills in how it is laid out.  The copy stays
+ * the same until the next CDATA_SNAPSHOT on this file and is read
+ * with pread() from offset 0, or mmap()ed read-only at
+ * CDATA_SNAPSHOT_OFFSET.  A mapping keeps the copy it was made from.
+ * Plain read() works too, but shares the file position with write().
+ */
+struct cdata_snapshot {
+	unsigned int	seq;
+	int		format;		/* CDATA_FMT_* */
+	unsigned int	width;
+	unsigned int	height;		/* rows in the virtual frame */
+	unsigned int	pitch;		/* bytes per row */
+	unsigned int	yoffset;	/* row at the top of the panel */
+	unsigned int	rotate;
+	unsigned int	size;		/* bytes of frame data */
+};
+
+#define	CDATA_SNAPSHOT		_IOR(0xCE, 14, struct cdata_snapshot)
+#define	CDATA_SNAPSHOT_OFFSET	(0x40000000)
+
+/*
+ * cdata-fb: batched drawing.  mmap() CDATA_RING_OFFSET to get the
+ * file's command ring, fill in commands from tail on, then ring the
+ * doorbell with CDATA_SUBMIT and the new tail.  head and tail count
+ * commands and never wrap back; command n is cmd[n % CDATA_RING_ENTRIES].
+ * The kernel runs the commands against the file's layer, moves head
+ * past them, counts the ones it could not run in error and flushes
+ * what they drew as one update.
+ *
+ *   FILL	w x h at (x, y) in color
+ *   COPY	w x h from (sx, sy) to (x, y); the areas may overlap
+ *   LINE	from (x, y) to (w, h), both ends included, in color
+ *   GLYPH	atlas glyph sx at (x, y) in color, background left alone
+ */
+#define	CDATA_CMD_NOP		0
+#define	CDATA_CMD_FILL		1
+#define	CDATA_CMD_COPY		2
+#define	CDATA_CMD_LINE		3
+#define	CDATA_CMD_GLYPH		4
+
+struct cdata_cmd {
+	unsigned char	op;
+	unsigned char	arg;
+	unsigned short	x, y;
+	unsigned short	w, h;
+	unsigned short	sx, sy;
+	unsigned short	pad;
+	unsigned int	color;		/* 0x00RRGGBB */
+};
+
+#define	CDATA_RING_ENTRIES	(256)
+
+struct cdata_ring {
+	unsigned int	head;		/* written by the kernel */
+	unsigned int	tail;		/* for the client's own use */
+	unsigned int	error;
+	unsigned int	pad;
+	struct cdata_cmd	cmd[CDATA_RING_ENTRIES];
+};
+
+#define	CDATA_SUBMIT_WAIT	(1 << 0)	/* return once they have run */
+
+struct cdata_submit {
+	unsigned int	tail;
+	unsigned int	flags;
+};
+
+#define	CDATA_SUBMIT		_IOW(0xCE, 15, struct cdata_submit)
+#define	CDATA_RING_OFFSET	(0x20000000)
+
+/*
+ * cdata-fb: text.  CDATA_SET_ATLAS uploads the file's font: count
+ * glyphs of width x height pixels, width at most 32, stored one after
+ * the other as height rows of (width+7)/8 bytes, most significant bit
+ * leftmost.  CDATA_TEXT then draws count glyphs into the file's layer
+ * in one update: set bits in fg, clear bits in bg, or left alone when
+ * bg is CDATA_TRANSPARENT.
+ */
+#define	CDATA_TRANSPARENT	(0xff000000)
+
+struct cdata_atlas {
+	unsigned int	width, height;
+	unsigned int	count;
+	const unsigned char	*bits;
+};
+
+struct cdata_glyph {
+	unsigned short	index;
+	unsigned short	x, y;
+	unsigned short	pad;
+	unsigned int	fg, bg;		/* 0x00RRGGBB */
+};
+
+struct cdata_text {
+	unsigned int	count;
+	const struct cdata_glyph	*glyphs;
+};
+
+#define	CDATA_SET_ATLAS		_IOW(0xCE, 16, struct cdata_atlas)
+#define	CDATA_TEXT		_IOW(0xCE, 17, struct cdata_text)
+
+/*
+ * cdata-fb: panel calibration, applied to every pixel on its way to
+ * the panel.  CDATA_CORR_LUT maps each channel through lut[0] (red),
+ * lut[1] (green) and lut[2] (blue); CDATA_CORR_DITHER then reduces
+ * every channel to dither_bits (1-8) with a 4x4 ordered dither that
+ * stays put on the panel.  flags 0 turns both off.
+ */
+#define	CDATA_CORR_LUT		(1 << 0)
+#define	CDATA_CORR_DITHER	(1 << 1)
+
+struct cdata_correction {
+	unsigned int	flags;
+	unsigned int	dither_bits;
+	unsigned char	lut[3][256];
+};
+
+#define	CDATA_SET_CORRECTION	_IOW(0xCE, 18, struct cdata_correction)
+
 #endif
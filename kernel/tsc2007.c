@@ -61,6 +61,48 @@
 #define READ_X		(ADC_ON_12BIT | TSC2007_MEASURE_X)
 #define PWRDOWN		(TSC2007_12BIT | TSC2007_POWER_OFF_IRQ_EN)
 
+/*
+ * A sample cycle is Y, X, Z1 and Z2, each converted oversample times
+ * and averaged, then a power down.  With combined set and an adapter
+ * that can do plain I2C, the whole cycle is one prepared i2c_transfer()
+ * of command/read message pairs; otherwise it is one SMBus word read
+ * per conversion.
+ */
+#define TSC2007_CHANNELS		4
+#define TSC2007_MAX_OVERSAMPLE		8
+#define TSC2007_MAX_MSGS \
+	(TSC2007_CHANNELS * TSC2007_MAX_OVERSAMPLE * 2 + 1)
+
+static bool combined = true;
+module_param(combined, bool, 0644);
+MODULE_PARM_DESC(combined, "read a whole sample cycle in one I2C transfer");
+
+static unsigned int oversample = 1;
+module_param(oversample, uint, 0644);
+MODULE_PARM_DESC(oversample, "conversions averaged per channel, 1-8");
+
+/*
+ * While the pen is down the poll period starts at poll_min_us and
+ * doubles, up to poll_max_us, for every sample that moved no more
+ * than dejitter on both axes.  The first sample that moves further
+ * drops it straight back to poll_min_us.
+ */
+static unsigned int poll_min_us = TS_POLL_PERIOD / NSEC_PER_USEC;
+module_param(poll_min_us, uint, 0644);
+MODULE_PARM_DESC(poll_min_us, "pen-down poll period while moving, us");
+
+static unsigned int poll_max_us = 20000;
+module_param(poll_max_us, uint, 0644);
+MODULE_PARM_DESC(poll_max_us, "pen-down poll period when still, us");
+
+static unsigned int dejitter = 4;
+module_param(dejitter, uint, 0644);
+MODULE_PARM_DESC(dejitter, "largest move still counted as stationary");
+
+static const u8 tsc2007_channel_cmd[TSC2007_CHANNELS] = {
+	READ_Y, READ_X, READ_Z1, READ_Z2
+};
+
 struct ts_event {
 	u16	x;
 	u16	y;
@@ -83,8 +125,25 @@ struct tsc2007 {
 	unsigned		pendown;
 	int			irq;
 
+	/* adaptive polling */
+	u64			period;		/* ns */
+	u16			last_x, last_y;
+
 	int			(*get_pendown_state)(void);
 	void			(*clear_penirq)(void);
+
+	/* the combined cycle, built for prepared conversions per channel */
+	bool			can_combine;
+	unsigned		prepared;
+	int			nmsgs;
+	struct i2c_msg		msgs[TSC2007_MAX_MSGS];
+	u8			cmd[TSC2007_CHANNELS + 1];
+	u8			rx[TSC2007_CHANNELS * TSC2007_MAX_OVERSAMPLE][2];
+
+	/* bus cost per reported event, under lock */
+	unsigned long		transactions;
+	unsigned long		messages;
+	unsigned long		events;
 };
 
 static inline int tsc2007_xfer(struct tsc2007 *tsc, u8 cmd)
@@ -93,6 +152,8 @@ static inline int tsc2007_xfer(struct tsc2007 *tsc, u8 cmd)
 	u16 val;
 
 	data = i2c_smbus_read_word_data(tsc->client, cmd);
+	tsc->transactions++;
+	tsc->messages += 2;
 	if (data < 0) {
 		dev_err(&tsc->client->dev, "i2c io error: %d\n", data);
 		return data;
@@ -109,11 +170,25 @@ static inline int tsc2007_xfer(struct tsc2007 *tsc, u8 cmd)
 	return val;
 }
 
+static ktime_t tsc2007_poll_period(struct tsc2007 *ts, bool still)
+{
+	u64 lo = (u64)max(poll_min_us, 1U) * NSEC_PER_USEC;
+	u64 hi = (u64)max(poll_max_us, poll_min_us) * NSEC_PER_USEC;
+
+	if (still)
+		ts->period = min(max(ts->period, lo) * 2, hi);
+	else
+		ts->period = lo;
+
+	return ns_to_ktime(ts->period);
+}
+
 static void tsc2007_send_event(void *tsc)
 {
 	struct tsc2007	*ts = tsc;
 	u32		rt;
 	u16		x, y, z1, z2;
+	bool		still = false;
 
 	x = ts->tc.x;
 	y = ts->tc.y;
@@ -142,7 +217,7 @@ static void tsc2007_send_event(void *tsc)
 	if (rt > MAX_12BIT) {
 		dev_dbg(&ts->client->dev, "ignored pressure %d\n", rt);
 
-		hrtimer_start(&ts->timer, ktime_set(0, TS_POLL_PERIOD),
+		hrtimer_start(&ts->timer, tsc2007_poll_period(ts, false),
 			      HRTIMER_MODE_REL);
 		return;
 	}
@@ -158,6 +233,12 @@ static void tsc2007_send_event(void *tsc)
 	if (rt) {
 		struct input_dev *input = ts->input;
 
+		still = ts->pendown &&
+			abs(x - ts->last_x) <= dejitter &&
+			abs(y - ts->last_y) <= dejitter;
+		ts->last_x = x;
+		ts->last_y = y;
+
 		if (!ts->pendown) {
 			dev_dbg(&ts->client->dev, "DOWN\n");
 
@@ -170,26 +251,93 @@ static void tsc2007_send_event(void *tsc)
 		input_report_abs(input, ABS_PRESSURE, rt);
 
 		input_sync(input);
+		ts->events++;
 
 		dev_dbg(&ts->client->dev, "point(%4d,%4d), pressure (%4u)\n",
 			x, y, rt);
 	}
 
-	hrtimer_start(&ts->timer, ktime_set(0, TS_POLL_PERIOD),
+	hrtimer_start(&ts->timer, tsc2007_poll_period(ts, still),
 			HRTIMER_MODE_REL);
 }
 
-static int tsc2007_read_values(struct tsc2007 *tsc)
+static void tsc2007_prepare(struct tsc2007 *tsc, unsigned n)
+{
+	struct i2c_client *client = tsc->client;
+	struct i2c_msg *msg = tsc->msgs;
+	int ch, i;
+
+	for (ch = 0; ch < TSC2007_CHANNELS; ch++) {
+		tsc->cmd[ch] = tsc2007_channel_cmd[ch];
+
+		for (i = 0; i < n; i++) {
+			msg->addr = client->addr;
+			msg->flags = client->flags & I2C_M_TEN;
+			msg->len = 1;
+			msg->buf = &tsc->cmd[ch];
+			msg++;
+
+			msg->addr = client->addr;
+			msg->flags = (client->flags & I2C_M_TEN) | I2C_M_RD;
+			msg->len = 2;
+			msg->buf = tsc->rx[ch * n + i];
+			msg++;
+		}
+	}
+
+	/* a bare command byte is enough to power down */
+	tsc->cmd[TSC2007_CHANNELS] = PWRDOWN;
+	msg->addr = client->addr;
+	msg->flags = client->flags & I2C_M_TEN;
+	msg->len = 1;
+	msg->buf = &tsc->cmd[TSC2007_CHANNELS];
+	msg++;
+
+	tsc->nmsgs = msg - tsc->msgs;
+	tsc->prepared = n;
+}
+
+static int tsc2007_read_combined(struct tsc2007 *tsc, unsigned n, u32 *sum)
 {
-	/* y- still on; turn on only y+ (and ADC) */
-	tsc->tc.y = tsc2007_xfer(tsc, READ_Y);
+	int ch, i, ret;
+	u8 *rx;
+
+	if (tsc->prepared != n)
+		tsc2007_prepare(tsc, n);
+
+	ret = i2c_transfer(tsc->client->adapter, tsc->msgs, tsc->nmsgs);
+	tsc->transactions++;
+	tsc->messages += tsc->nmsgs;
+	if (ret != tsc->nmsgs) {
+		dev_err(&tsc->client->dev, "i2c io error: %d\n", ret);
+		return ret < 0 ? ret : -EIO;
+	}
 
-	/* turn y- off, x+ on, then leave in lowpower */
-	tsc->tc.x = tsc2007_xfer(tsc, READ_X);
+	/* [D11-D4] then [D3-D0 << 4 | dummy], as for the word reads */
+	for (ch = 0; ch < TSC2007_CHANNELS; ch++)
+		for (i = 0; i < n; i++) {
+			rx = tsc->rx[ch * n + i];
+			sum[ch] += (rx[0] << 4) | (rx[1] >> 4);
+		}
 
-	/* turn y+ off, x- on; we'll use formula #1 */
-	tsc->tc.z1 = tsc2007_xfer(tsc, READ_Z1);
-	tsc->tc.z2 = tsc2007_xfer(tsc, READ_Z2);
+	return 0;
+}
+
+static int tsc2007_read_words(struct tsc2007 *tsc, unsigned n, u32 *sum)
+{
+	int ch, i, val;
+
+	/*
+	 * y- still on; turn on only y+ (and ADC), then y- off, x+ on;
+	 * then y+ off, x- on; we'll use formula #1
+	 */
+	for (ch = 0; ch < TSC2007_CHANNELS; ch++)
+		for (i = 0; i < n; i++) {
+			val = tsc2007_xfer(tsc, tsc2007_channel_cmd[ch]);
+			if (val < 0)
+				return val;
+			sum[ch] += val;
+		}
 
 	/* power down */
 	tsc2007_xfer(tsc, PWRDOWN);
@@ -197,6 +345,27 @@ static int tsc2007_read_values(struct tsc2007 *tsc)
 	return 0;
 }
 
+static int tsc2007_read_values(struct tsc2007 *tsc)
+{
+	u32 sum[TSC2007_CHANNELS] = { 0 };
+	unsigned n = clamp_t(unsigned, oversample, 1, TSC2007_MAX_OVERSAMPLE);
+	int ret;
+
+	if (combined && tsc->can_combine)
+		ret = tsc2007_read_combined(tsc, n, sum);
+	else
+		ret = tsc2007_read_words(tsc, n, sum);
+	if (ret)
+		return ret;
+
+	tsc->tc.y = (sum[0] + n / 2) / n;
+	tsc->tc.x = (sum[1] + n / 2) / n;
+	tsc->tc.z1 = (sum[2] + n / 2) / n;
+	tsc->tc.z2 = (sum[3] + n / 2) / n;
+
+	return 0;
+}
+
 static enum hrtimer_restart tsc2007_timer(struct hrtimer *handle)
 {
 	struct tsc2007 *ts = container_of(handle, struct tsc2007, timer);
@@ -211,6 +380,7 @@ static enum hrtimer_restart tsc2007_timer(struct hrtimer *handle)
 		input_report_key(input, BTN_TOUCH, 0);
 		input_report_abs(input, ABS_PRESSURE, 0);
 		input_sync(input);
+		ts->events++;
 
 		ts->pendown = 0;
 		enable_irq(ts->irq);
@@ -218,8 +388,12 @@ static enum hrtimer_restart tsc2007_timer(struct hrtimer *handle)
 		/* pen is still down, continue with the measurement */
 		dev_dbg(&ts->client->dev, "pen is still down\n");
 
-		tsc2007_read_values(ts);
-		tsc2007_send_event(ts);
+		if (tsc2007_read_values(ts) == 0)
+			tsc2007_send_event(ts);
+		else
+			hrtimer_start(&ts->timer,
+				      tsc2007_poll_period(ts, false),
+				      HRTIMER_MODE_REL);
 	}
 
 	spin_unlock_irq(&ts->lock);
@@ -248,6 +422,43 @@ static irqreturn_t tsc2007_irq(int irq, void *handle)
 	return IRQ_HANDLED;
 }
 
+static ssize_t tsc2007_stats_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct tsc2007 *ts = i2c_get_clientdata(to_i2c_client(dev));
+	unsigned long transactions, messages, events, per;
+
+	spin_lock_irq(&ts->lock);
+	transactions = ts->transactions;
+	messages = ts->messages;
+	events = ts->events;
+	spin_unlock_irq(&ts->lock);
+
+	/* hundredths of a transaction per event */
+	per = events ? transactions * 100 / events : 0;
+
+	return sprintf(buf, "transactions %lu\nmessages %lu\nevents %lu\n"
+		       "transactions/event %lu.%02lu\n",
+		       transactions, messages, events, per / 100, per % 100);
+}
+
+static ssize_t tsc2007_stats_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	struct tsc2007 *ts = i2c_get_clientdata(to_i2c_client(dev));
+
+	spin_lock_irq(&ts->lock);
+	ts->transactions = 0;
+	ts->messages = 0;
+	ts->events = 0;
+	spin_unlock_irq(&ts->lock);
+
+	return count;
+}
+
+static DEVICE_ATTR(stats, 0644, tsc2007_stats_show, tsc2007_stats_store);
+
 static int tsc2007_probe(struct i2c_client *client,
 			const struct i2c_device_id *id)
 {
@@ -286,6 +497,8 @@ static int tsc2007_probe(struct i2c_client *client,
 	ts->x_plate_ohms      = pdata->x_plate_ohms;
 	ts->get_pendown_state = pdata->get_pendown_state;
 	ts->clear_penirq      = pdata->clear_penirq;
+	ts->can_combine       = i2c_check_functionality(client->adapter,
+							I2C_FUNC_I2C);
 
 	pdata->init_platform_hw();
 
@@ -305,26 +518,34 @@ static int tsc2007_probe(struct i2c_client *client,
 
 	tsc2007_read_values(ts);
 
+	/* before the irq, so that nothing past it needs unregistering */
+	err = device_create_file(&client->dev, &dev_attr_stats);
+	if (err)
+		goto err_free_mem;
+
 	ts->irq = client->irq;
 
 	err = request_irq(ts->irq, tsc2007_irq, 0,
 			client->dev.driver->name, ts);
 	if (err < 0) {
 		dev_err(&client->dev, "irq %d busy?\n", ts->irq);
-		goto err_free_mem;
+		goto err_remove_file;
 	}
 
 	err = input_register_device(input_dev);
 	if (err)
 		goto err_free_irq;
 
-	dev_info(&client->dev, "registered with irq (%d)\n", ts->irq);
+	dev_info(&client->dev, "registered with irq (%d)%s\n", ts->irq,
+		 ts->can_combine ? ", combined reads" : "");
 
 	return 0;
 
  err_free_irq:
 	free_irq(ts->irq, ts);
 	hrtimer_cancel(&ts->timer);
+ err_remove_file:
+	device_remove_file(&client->dev, &dev_attr_stats);
  err_free_mem:
 	input_free_device(input_dev);
 	kfree(ts);
@@ -339,6 +560,7 @@ static int tsc2007_remove(struct i2c_client *client)
 	pdata = client->dev.platform_data;
 	pdata->exit_platform_hw();
 
+	device_remove_file(&client->dev, &dev_attr_stats);
 	free_irq(ts->irq, ts);
 	hrtimer_cancel(&ts->timer);
 	input_unregister_device(ts->input);
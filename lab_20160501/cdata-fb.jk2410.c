@@ -130,38 +130,48 @@ static int cdata_close(struct inode *inode, struct file *filp)
 	return 0;
 }
 
+/*
+ * Copy n bytes of buf to the panel at fb_cur, wrapping at LCD_LENGTH.
+ * n must not exceed LCD_LENGTH, so at most two contiguous bursts are
+ * issued: one up to the end of panel memory and one from its start.
+ * Returns the new fb_cur.
+ */
+static unsigned int lcd_burst(unsigned char *fb, unsigned int fb_cur,
+			const unsigned char *buf, unsigned int n)
+{
+	unsigned int len;
+
+	len = LCD_LENGTH - fb_cur;
+	if (len > n)
+	    len = n;
+
+	memcpy_toio(fb+fb_cur, buf, len);
+	fb_cur += len;
+	n -= len;
+
+	if (fb_cur >= LCD_LENGTH)
+	    fb_cur = 0;
+
+	if (n) {
+	    /* for debug: let the first half show up before the wrap */
+	    if (delay == 1)
+	        schedule();
+
+	    memcpy_toio(fb, buf+len, n);
+	    fb_cur = n;
+	}
+
+	return fb_cur;
+}
+
 /* is it reentrant code ? */
 static void lcd_write(void * priv)
 {
 	struct	cdata_t	*cdata = (struct cdata_t *)priv;
-	int i, n;
-	unsigned char *buf;
-	unsigned char *fb;
-	unsigned int fb_cur;
-	int j;
-
-	//n = cdata->buf_idx;
-	buf = cdata->buf;
-	fb = cdata->fb;
-	fb_cur = cdata->fb_cur;
-
-	for (i = 0; i < BUF_LENGTH; i++) {
-	    writeb(buf[i], fb+fb_cur);
-	    fb_cur++;
-
-	    if (fb_cur >= LCD_LENGTH)
-		fb_cur = 0;
-
-	    /* for debug */
-	    if (delay == 1) {
-	        schedule();
-	        for (j = 0; j < 10000; j++)
-		    ;
-	    }
-	}
 
+	cdata->fb_cur = lcd_burst(cdata->fb, cdata->fb_cur,
+					cdata->buf, BUF_LENGTH);
 	cdata->buf_idx = 0;
-	cdata->fb_cur = fb_cur;
 
 	wake_up(&cdata->wq);
 }
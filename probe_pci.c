@@ -13,23 +13,233 @@
 #include <linux/miscdevice.h>
 #include <linux/input.h>
 #include <linux/pci.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/slab.h>
 #include <asm/io.h>
 #include <asm/uaccess.h>
+#include <asm/unaligned.h>
 
 struct pci_device_id vga_pci_tbl[] = {
 	{0x80ee, 0xbeef, PCI_ANY_ID, PCI_ANY_ID, 0, 0, 0},
+	{0x1234, 0x1111, PCI_ANY_ID, PCI_ANY_ID, 0, 0, 0},	/* QEMU -device VGA */
 	{0,}
 };
 
 MODULE_DEVICE_TABLE(pci, vga_pci_tbl);
 
+/*
+ * bench=1 times the BAR write paths at probe time.  Under QEMU:
+ *
+ *   qemu-system-x86_64 -device VGA ...
+ *   insmod probe_pci.ko bench=1
+ */
+static bool bench;
+module_param(bench, bool, 0444);
+MODULE_PARM_DESC(bench, "measure BAR0 write bandwidth at probe time");
+
+#define	BENCH_LENGTH	(1024*1024)
+
 unsigned int video_base;
+unsigned int video_len;
 unsigned char *video_vbase;
 
-int vga_probe(struct pci_dev *dev, const struct pci_device_id *id) 
+/************************ BAR access ******************************/
+
+/*
+ * Fill len bytes of the BAR at off with a byte value.  Only the
+ * unaligned head and tail go out a byte at a time; the rest is
+ * written one native word per access so the write-combining buffer
+ * sees whole bursts.
+ */
+static void vga_fill(unsigned char *base, unsigned int off, u8 val,
+			unsigned int len)
 {
-	unsigned int len;
-	int i;
+	unsigned char *p = base + off;
+	unsigned long v;
+
+	v = val;
+	v |= v << 8;
+	v |= v << 16;
+#if BITS_PER_LONG == 64
+	v |= v << 32;
+#endif
+
+	while (len && ((unsigned long)p & (sizeof(long)-1))) {
+	    writeb(val, p++);
+	    len--;
+	}
+
+	for (; len >= sizeof(long); len -= sizeof(long), p += sizeof(long)) {
+#if BITS_PER_LONG == 64
+	    writeq(v, p);
+#else
+	    writel(v, p);
+#endif
+	}
+
+	while (len--)
+	    writeb(val, p++);
+}
+
+/* the same for a copy; src may have any alignment */
+static void vga_copy(unsigned char *base, unsigned int off,
+			const unsigned char *src, unsigned int len)
+{
+	unsigned char *p = base + off;
+
+	while (len && ((unsigned long)p & (sizeof(long)-1))) {
+	    writeb(*src++, p++);
+	    len--;
+	}
+
+	for (; len >= sizeof(long); len -= sizeof(long)) {
+#if BITS_PER_LONG == 64
+	    writeq(get_unaligned((u64 *)src), p);
+#else
+	    writel(get_unaligned((u32 *)src), p);
+#endif
+	    src += sizeof(long);
+	    p += sizeof(long);
+	}
+
+	while (len--)
+	    writeb(*src++, p++);
+}
+
+/************************ misc ******************************/
+
+static int vga_open(struct inode *inode, struct file *filp)
+{
+	if (!video_vbase)
+	    return -ENODEV;
+
+	return 0;
+}
+
+static ssize_t vga_write(struct file *filp, const char __user *buf,
+			size_t size, loff_t *off)
+{
+	unsigned char *tmp;
+	size_t done = 0;
+	unsigned int n;
+
+	/* nothing to copy is not a fault, wherever it is */
+	if (!size)
+	    return 0;
+	if (*off >= video_len)
+	    return -ENOSPC;
+	if (size > video_len - *off)
+	    size = video_len - *off;
+
+	tmp = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!tmp)
+	    return -ENOMEM;
+
+	while (done < size) {
+	    n = min_t(size_t, size - done, PAGE_SIZE);
+	    if (copy_from_user(tmp, buf + done, n))
+		break;
+	    vga_copy(video_vbase, *off + done, tmp, n);
+	    done += n;
+	}
+
+	kfree(tmp);
+
+	*off += done;
+
+	return done ? done : -EFAULT;
+}
+
+/* map BAR0 write-combined, like the kernel side */
+static int vga_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	unsigned long size = vma->vm_end - vma->vm_start;
+	unsigned long off = vma->vm_pgoff << PAGE_SHIFT;
+
+	if (off >= video_len || size > video_len - off)
+	    return -EINVAL;
+
+	vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+
+	return io_remap_pfn_range(vma, vma->vm_start,
+			(video_base + off) >> PAGE_SHIFT, size,
+			vma->vm_page_prot);
+}
+
+static struct file_operations vga_fops = {
+	owner:		THIS_MODULE,
+	open:		vga_open,
+	write:		vga_write,
+	mmap:		vga_mmap,
+};
+
+static struct miscdevice vga_misc = {
+	minor:		MISC_DYNAMIC_MINOR,
+	name:		"vga-fb",
+	fops:		&vga_fops,
+};
+
+/************************ benchmark ******************************/
+
+static void vga_bench_report(const char *name, ktime_t t0, unsigned int len)
+{
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), t0));
+
+	printk(KERN_ALERT "probe_pci: %-12s %u bytes in %llu ns, %llu MB/s\n",
+		name, len, ns, div64_u64((u64)len * 1000, ns ? ns : 1));
+}
+
+/*
+ * The same BAR0 range written three ways: a byte at a time through an
+ * uncached mapping (what probe used to do), a byte at a time through
+ * the write-combined mapping, and word bursts through it.
+ *
+ * The uncached pass has to run before the BAR is mapped write-combined:
+ * with PAT a second mapping inherits the first one's memory type, and
+ * "uncached" would quietly be write-combined too.
+ */
+static void vga_bench_uc(unsigned int len)
+{
+	unsigned char *uc;
+	ktime_t t0;
+	unsigned int i;
+
+	uc = ioremap_nocache(video_base, len);
+	if (!uc)
+	    return;
+
+	t0 = ktime_get();
+	for (i = 0; i < len; i++)
+	    writeb(0x33, uc+i);
+	mb();
+	vga_bench_report("uncached", t0, len);
+
+	iounmap(uc);
+}
+
+static void vga_bench_wc(unsigned int len)
+{
+	ktime_t t0;
+	unsigned int i;
+
+	t0 = ktime_get();
+	for (i = 0; i < len; i++)
+	    writeb(0x55, video_vbase+i);
+	wmb();
+	vga_bench_report("wc", t0, len);
+
+	t0 = ktime_get();
+	vga_fill(video_vbase, 0, 0x77, len);
+	wmb();
+	vga_bench_report("wc-burst", t0, len);
+}
+
+/******************************************************/
+
+int vga_probe(struct pci_dev *dev, const struct pci_device_id *id)
+{
+	int ret;
 	u16 vendorID;
 
  	if (pci_enable_device(dev))
@@ -37,24 +247,55 @@ int vga_probe(struct pci_dev *dev, const struct pci_device_id *id)
 
 	pci_read_config_word(dev, 0x00, &vendorID);
 
+	ret = pci_request_region(dev, 0, "vga-fb");
+	if (ret)
+	    goto fail_region;
+
 	video_base = pci_resource_start(dev, 0);
-	
-	len = pci_resource_len(dev, 0);
+
+	video_len = pci_resource_len(dev, 0);
 
 	printk(KERN_ALERT "probe_pci: vga found. fb = %08x, size = %d\n",
-				video_base, len);
+				video_base, video_len);
 
-	video_vbase = ioremap(video_base, len);
+	if (bench)
+	    vga_bench_uc(min_t(unsigned int, video_len, BENCH_LENGTH));
 
-	/* TESTING */
-	for (i = 0; i < 100000; i++) {
-	    writeb(0x33, video_vbase+i);
+	video_vbase = ioremap_wc(video_base, video_len);
+	if (!video_vbase) {
+	    ret = -ENOMEM;
+	    goto fail_map;
 	}
 
+	if (bench)
+	    vga_bench_wc(min_t(unsigned int, video_len, BENCH_LENGTH));
+
+	vga_fill(video_vbase, 0, 0x00, video_len);
+
+	ret = misc_register(&vga_misc);
+	if (ret)
+	    goto fail_misc;
+
 	return 0;
+
+fail_misc:
+	iounmap(video_vbase);
+	video_vbase = NULL;
+fail_map:
+	pci_release_region(dev, 0);
+fail_region:
+	pci_disable_device(dev);
+	return ret;
 }
 
 void vga_remove(struct pci_dev *dev) {
+	misc_deregister(&vga_misc);
+
+	iounmap(video_vbase);
+	video_vbase = NULL;
+
+	pci_release_region(dev, 0);
+	pci_disable_device(dev);
 }
 
 static struct pci_driver vga_fb = {
@@ -80,4 +321,3 @@ module_init(probe_pci_init_module);
 module_exit(probe_pci_cleanup_module);
 
 MODULE_LICENSE("GPL");
-
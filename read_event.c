@@ -1,6 +1,13 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <glob.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
 #include <linux/input.h>
 
 /*
@@ -12,41 +19,253 @@ struct input_event {
 };
 */
 
-#define FILE_PATH "/dev/input/event0"
+/*
+ * Watch every input device at once and show which one is busy:
+ *
+ *   read_event [-n events] [-i seconds] [-v] [device ...]
+ *
+ * With no devices given it opens all of /dev/input/event*.  Each
+ * wakeup drains up to -n events per read().  Every -i seconds it
+ * prints, per active device, events and SYN_REPORT frames per second,
+ * the delay from the kernel's event timestamp to our read(), and how
+ * many SYN_DROPPED the evdev buffer overflowed into.
+ */
 
-int main()
-{
-	struct input_event event[8];
+#define DEV_GLOB	"/dev/input/event*"
+#define MAX_DEVS	64
+#define MAX_BATCH	4096
+
+struct dev {
+	char path[64];
+	char name[64];
 	int fd;
+	clockid_t clock;	/* what its timestamps are in */
+	int dropping;		/* SYN_DROPPED seen, waiting for SYN_REPORT */
+
+	/* this interval */
+	unsigned long events;
+	unsigned long frames;
+	unsigned long dropped;
+	unsigned long long lat_sum;	/* us */
+	unsigned long long lat_max;
+};
+
+static struct dev devs[MAX_DEVS];
+static int ndevs;
+static int verbose;
+
+static long long now_us(clockid_t clock)
+{
+	struct timespec ts;
 
-	printf("Reading %s\n", FILE_PATH);
+	clock_gettime(clock, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
+static int add_dev(const char *path)
+{
+	struct dev *d;
+	int clk = CLOCK_MONOTONIC;
 
-	fd = open(FILE_PATH, O_RDWR);
+	if (ndevs == MAX_DEVS) {
+		printf("ERROR: more than %d devices, %s skipped\n",
+			MAX_DEVS, path);
+		return -1;
+	}
 
-	if(fd < 0)
-	{
-		printf("ERROR: %s can not open\n", FILE_PATH);
-		exit(0);
+	d = &devs[ndevs];
+	memset(d, 0, sizeof(*d));
+
+	d->fd = open(path, O_RDONLY | O_NONBLOCK);
+	if (d->fd < 0) {
+		printf("ERROR: %s can not open: %s\n", path, strerror(errno));
+		return -1;
 	}
 
-    read(fd, &event, sizeof(struct input_event)*2);
+	snprintf(d->path, sizeof(d->path), "%s", path);
+	if (ioctl(d->fd, EVIOCGNAME(sizeof(d->name)), d->name) < 0)
+		strcpy(d->name, "?");
+
+	/* timestamps on our monotonic clock, or we are stuck with wall time */
+	d->clock = CLOCK_MONOTONIC;
+	if (ioctl(d->fd, EVIOCSCLOCKID, &clk) < 0)
+		d->clock = CLOCK_REALTIME;
 
-    /**
-     * Input event codes:
-     *    http://www.kernel.org/doc/Documentation/input/event-codes.txt
-     *
-     */
-    switch (event[0].code) {       // type is EV_ABS
-        case ABS_X:
-            printf("X: %d\n", event[0].value);
-            break;
-        case ABS_Y:
-            printf("Y: %d\n", event[0].value);
-            break;
-    }
+	ndevs++;
 
-	close(fd);
 	return 0;
 }
 
+static void handle(struct dev *d, const struct input_event *ev, int n)
+{
+	long long now = now_us(d->clock);
+	long long t, lat;
+	int i;
+
+	for (i = 0; i < n; i++, ev++) {
+		d->events++;
+
+		t = (long long)ev->time.tv_sec * 1000000 + ev->time.tv_usec;
+		lat = now - t;
+		if (lat < 0)
+			lat = 0;
+		d->lat_sum += lat;
+		if ((unsigned long long)lat > d->lat_max)
+			d->lat_max = lat;
+
+		if (ev->type == EV_SYN) {
+			switch (ev->code) {
+			case SYN_DROPPED:
+				d->dropped++;
+				d->dropping = 1;
+				break;
+			case SYN_REPORT:
+				d->frames++;
+				d->dropping = 0;
+				break;
+			}
+			continue;
+		}
+
+		if (verbose && !d->dropping)
+			printf("%s: type %d code %d value %d\n", d->path,
+				ev->type, ev->code, ev->value);
+	}
+}
+
+static void report(double secs)
+{
+	struct dev *d;
+	int i;
+
+	printf("%-20s %-24s %9s %9s %9s %9s %8s\n", "device", "name",
+		"events/s", "frames/s", "avg us", "max us", "dropped");
+
+	for (i = 0; i < ndevs; i++) {
+		d = &devs[i];
+		if (!d->events)
+			continue;
+
+		printf("%-20s %-24.24s %9.0f %9.0f %9llu %9llu %8lu\n",
+			d->path, d->name, d->events / secs, d->frames / secs,
+			d->lat_sum / d->events, d->lat_max, d->dropped);
+
+		d->events = d->frames = d->dropped = 0;
+		d->lat_sum = d->lat_max = 0;
+	}
+	printf("\n");
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	static struct input_event buf[MAX_BATCH];
+	struct epoll_event ev[MAX_DEVS];
+	long long last, now;
+	int batch = 64, interval = 1;
+	int ep, opt, i, n;
+	ssize_t len;
+	glob_t g;
+
+	while ((opt = getopt(argc, argv, "n:i:v")) != -1) {
+		switch (opt) {
+		case 'n':
+			batch = atoi(optarg);
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			printf("usage: %s [-n events] [-i seconds] [-v] "
+				"[device ...]\n", argv[0]);
+			exit(1);
+		}
+	}
+
+	if (batch < 1 || batch > MAX_BATCH)
+		batch = MAX_BATCH;
+	if (interval < 1)
+		interval = 1;
+
+	if (optind < argc) {
+		for (i = optind; i < argc; i++)
+			add_dev(argv[i]);
+	} else if (glob(DEV_GLOB, 0, NULL, &g) == 0) {
+		for (i = 0; i < (int)g.gl_pathc; i++)
+			add_dev(g.gl_pathv[i]);
+		globfree(&g);
+	}
+
+	if (!ndevs) {
+		printf("ERROR: no input devices\n");
+		exit(1);
+	}
+
+	ep = epoll_create1(0);
+	if (ep < 0) {
+		perror("epoll_create1");
+		exit(1);
+	}
+
+	for (i = 0; i < ndevs; i++) {
+		struct epoll_event e;
+
+		e.events = EPOLLIN;
+		e.data.ptr = &devs[i];
+		if (epoll_ctl(ep, EPOLL_CTL_ADD, devs[i].fd, &e) < 0)
+			perror(devs[i].path);
+
+		printf("Reading %s (%s)\n", devs[i].path, devs[i].name);
+	}
+
+	last = now_us(CLOCK_MONOTONIC);
+
+	for (;;) {
+		now = now_us(CLOCK_MONOTONIC);
+		if (now - last >= interval * 1000000LL) {
+			report((now - last) / 1e6);
+			last = now;
+		}
+
+		n = epoll_wait(ep, ev, MAX_DEVS,
+			(int)((last + interval * 1000000LL - now) / 1000) + 1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			struct dev *d = ev[i].data.ptr;
+
+			/* drain it, batch events per read() */
+			for (;;) {
+				len = read(d->fd, buf,
+					batch * sizeof(struct input_event));
+				if (len <= 0)
+					break;
+				handle(d, buf, len / sizeof(struct input_event));
+			}
+
+			/* unplugged */
+			if (len == 0 || (len < 0 && errno != EAGAIN)) {
+				printf("%s: %s, closed\n", d->path,
+					len ? strerror(errno) : "end of file");
+				epoll_ctl(ep, EPOLL_CTL_DEL, d->fd, NULL);
+				close(d->fd);
+				d->fd = -1;
+			}
+		}
+	}
+
+	for (i = 0; i < ndevs; i++)
+		if (devs[i].fd >= 0)
+			close(devs[i].fd);
+	close(ep);
+
+	return 0;
+}